@@ -0,0 +1,330 @@
+// Microbenchmarks for the building blocks behind every index: distance
+// kernels, PQ encoding and ADC scans, k-means and the top-k heap.
+//
+//   benchmark_micro [filter...]
+//
+// Runs every benchmark whose name contains one of the filters, or all of
+// them. Each row reports the best of several trials. GB/s counts the bytes
+// an op has to read from its working set, GFLOP/s the arithmetic it does,
+// and the counter columns appear when perf_event is usable.
+
+#include "math/kmeans.h"
+#include "math/math.h"
+#include "math/pq.h"
+#include "math/topk.h"
+#include "perf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace spheni;
+using Clock = std::chrono::steady_clock;
+
+constexpr double kMinSeconds = 0.2;
+constexpr int kTrials = 3;
+
+template <class T> void keep(const T &value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+}
+
+std::vector<std::string> filters;
+bench::PerfCounters counters;
+
+bool selected(const char *name) {
+        if (filters.empty())
+                return true;
+        for (const auto &f : filters)
+                if (std::strstr(name, f.c_str()))
+                        return true;
+        return false;
+}
+
+// Per-op cost of a benchmark, for the throughput columns. Zero prints "-".
+struct Work {
+        double bytes = 0;
+        double flops = 0;
+};
+
+void print_header() {
+        std::printf("%-22s %-36s %12s %8s %8s %9s %6s %10s\n", "benchmark",
+                    "params", "ns/op", "GB/s", "GFLOP/s", "cycles/op", "IPC",
+                    "misses/op");
+}
+
+void print_rate(double value) {
+        if (value > 0)
+                std::printf(" %8.2f", value);
+        else
+                std::printf(" %8s", "-");
+}
+
+// Times `call`, which performs `ops` ops, enough times to fill kMinSeconds
+// per trial, and prints the best trial.
+template <class Fn>
+void run(const char *name, const std::string &params, double ops,
+         const Work &work, Fn &&call) {
+        if (!selected(name))
+                return;
+        call();
+        const auto t0 = Clock::now();
+        call();
+        const double once =
+            std::chrono::duration<double>(Clock::now() - t0).count();
+        const long long calls =
+            std::max(1LL, (long long)(kMinSeconds / std::max(once, 1e-9)));
+
+        double best_ns = 0;
+        bench::CounterValues best_counts;
+        for (int t = 0; t < kTrials; t++) {
+                counters.start();
+                const auto start = Clock::now();
+                for (long long c = 0; c < calls; c++)
+                        call();
+                const double ns = std::chrono::duration<double, std::nano>(
+                                      Clock::now() - start)
+                                      .count();
+                const auto counts = counters.stop();
+                const double per_op = ns / (calls * ops);
+                if (t == 0 || per_op < best_ns) {
+                        best_ns = per_op;
+                        best_counts = counts;
+                }
+        }
+
+        std::printf("%-22s %-36s %12.2f", name, params.c_str(), best_ns);
+        print_rate(work.bytes / best_ns);
+        print_rate(work.flops / best_ns);
+        if (counters.available() && best_counts.cycles > 0) {
+                const double total = calls * ops;
+                std::printf(" %9.1f %6.2f %10.3f", best_counts.cycles / total,
+                            (double)best_counts.instructions /
+                                best_counts.cycles,
+                            best_counts.cache_misses / total);
+        } else {
+                std::printf(" %9s %6s %10s", "-", "-", "-");
+        }
+        std::printf("\n");
+}
+
+std::vector<float> random_floats(size_t n, unsigned seed) {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+        std::vector<float> out(n);
+        for (auto &x : out)
+                x = u(rng);
+        return out;
+}
+
+std::string format(const char *fmt, int a, int b = 0, int c = 0) {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), fmt, a, b, c);
+        return buf;
+}
+
+const int kDims[] = {32, 64, 96, 128, 256, 768, 1024};
+
+// Working sets that stay in L1 and that spill to DRAM.
+struct WorkingSet {
+        const char *name;
+        size_t bytes;
+};
+const WorkingSet kSets[] = {{"L1", 16 << 10}, {"DRAM", 256 << 20}};
+
+void bench_distances(const std::vector<float> &pool) {
+        const bool want_dot = selected("dot") || selected("dot/select");
+        const bool want_l2 =
+            selected("l2_squared") || selected("l2_squared/select");
+        if (!want_dot && !want_l2)
+                return;
+        for (const WorkingSet &set : kSets) {
+                for (int d : kDims) {
+                        const int n = set.bytes / (d * sizeof(float));
+                        const float *q = pool.data();
+                        const float *base = pool.data() + d;
+                        const auto params = format("d=%d n=%d ", d, n) +
+                                            set.name;
+                        const Work dot_work{d * 4.0, 2.0 * d};
+                        const Work l2_work{d * 4.0, 3.0 * d};
+
+                        auto scan = [&](math::kernels::DistFn fn) {
+                                return [=] {
+                                        float sum = 0;
+                                        for (int i = 0; i < n; i++)
+                                                sum += fn(q, base + i * d, d);
+                                        keep(sum);
+                                };
+                        };
+                        if (want_dot) {
+                                run("dot", params, n, dot_work,
+                                    scan(math::kernels::dot));
+                                run("dot/select", params, n, dot_work,
+                                    scan(math::kernels::select_dot(d)));
+                        }
+                        if (want_l2) {
+                                run("l2_squared", params, n, l2_work,
+                                    scan(math::kernels::l2_squared));
+                                run("l2_squared/select", params, n, l2_work,
+                                    scan(math::kernels::select_l2(d)));
+                        }
+                }
+        }
+}
+
+void bench_normalize(std::vector<float> &pool) {
+        if (!selected("normalize"))
+                return;
+        for (const WorkingSet &set : kSets) {
+                for (int d : kDims) {
+                        const int n = set.bytes / (d * sizeof(float));
+                        float *base = pool.data();
+                        // Two passes over the vector, one of them writing.
+                        run("normalize",
+                            format("d=%d n=%d ", d, n) + set.name, n,
+                            Work{d * 12.0, 3.0 * d}, [=] {
+                                    for (int i = 0; i < n; i++)
+                                            math::kernels::normalize(
+                                                base + i * d, d);
+                                    keep(base[0]);
+                            });
+                }
+        }
+}
+
+struct PQShape {
+        int dim, M;
+};
+const PQShape kPQShapes[] = {{64, 8}, {128, 8}, {128, 16}, {128, 32},
+                             {256, 32}};
+
+void bench_pq(const std::vector<float> &pool) {
+        const bool want_scan = selected("pq/approx_distance") ||
+                               selected("pq/approx_distances");
+        if (!want_scan && !selected("pq/encode") &&
+            !selected("pq/precompute_table") &&
+            !selected("pq/precompute_ip_table"))
+                return;
+        const int ksub = 256;
+        for (const PQShape &shape : kPQShapes) {
+                const int dim = shape.dim, M = shape.M;
+                const auto params = format("d=%d M=%d ksub=%d", dim, M, ksub);
+                // Codebook quality does not matter for timing, so training
+                // uses a small sample.
+                math::ProductQuantizer pq(dim, M, ksub);
+                pq.train(std::span<const float>(pool.data(), 4 * ksub * dim));
+
+                // Every subvector is compared with every codeword.
+                const Work full{(double)ksub * dim * 4, 3.0 * ksub * dim};
+                std::span<const float> vecs(pool.data(), 1024 * dim);
+                run("pq/encode", params, 1024, Work{dim * 4.0, full.flops},
+                    [&] { keep(pq.encode(vecs)); });
+                run("pq/precompute_table", params, 1, full,
+                    [&] { keep(pq.precompute_table(pool.data())); });
+                run("pq/precompute_ip_table", params, 1,
+                    Work{full.bytes, 2.0 * ksub * dim},
+                    [&] { keep(pq.precompute_ip_table(pool.data())); });
+                if (!want_scan)
+                        continue;
+
+                const auto table = pq.precompute_table(pool.data());
+                for (const WorkingSet &set : kSets) {
+                        const int n = set.bytes / M;
+                        std::vector<uint8_t> codes(set.bytes);
+                        std::mt19937 rng(7);
+                        for (auto &c : codes)
+                                c = rng() % ksub;
+                        const auto scan_params =
+                            params + format(" n=%d ", n) + set.name;
+                        const Work adc{(double)M, (double)M};
+                        run("pq/approx_distance", scan_params, n, adc, [&] {
+                                float sum = 0;
+                                for (int i = 0; i < n; i++)
+                                        sum += pq.approx_distance(
+                                            table, codes.data() + i * M);
+                                keep(sum);
+                        });
+                        const int block = math::ProductQuantizer::kScanBlock;
+                        std::vector<float> out(block);
+                        run("pq/approx_distances", scan_params, n, adc, [&] {
+                                for (int i0 = 0; i0 < n; i0 += block)
+                                        pq.approx_distances(
+                                            table, codes.data() + i0 * M,
+                                            std::min(block, n - i0),
+                                            out.data());
+                                keep(out[0]);
+                        });
+                }
+        }
+}
+
+struct KMeansShape {
+        int n, dim, k;
+};
+const KMeansShape kKMeansShapes[] = {
+    {10000, 32, 64}, {10000, 128, 64}, {5000, 64, 128}};
+
+// One op is a whole fit, k-means++ seeding included. Lloyd iterations stop
+// at max_iters, so no throughput is reported.
+void bench_kmeans(const std::vector<float> &pool) {
+        for (const KMeansShape &s : kKMeansShapes) {
+                std::span<const float> vecs(pool.data(), s.n * s.dim);
+                run("kmeans/fit",
+                    format("n=%d d=%d k=%d", s.n, s.dim, s.k) + " iters=10", 1,
+                    Work{}, [&] {
+                            math::clustering::KMeans km(s.k, s.dim, 10);
+                            keep(km.fit(vecs));
+                    });
+        }
+}
+
+// Random scores insert rarely once the heap fills; ascending scores insert
+// on every push.
+void bench_topk() {
+        if (!selected("topk/push"))
+                return;
+        const int n = 1 << 20;
+        auto random = random_floats(n, 3);
+        std::vector<float> ascending(n);
+        for (int i = 0; i < n; i++)
+                ascending[i] = (float)i;
+        for (int k : {10, 100, 1000}) {
+                for (const auto *scores : {&random, &ascending}) {
+                        const char *order =
+                            scores == &random ? "random" : "ascending";
+                        run("topk/push",
+                            format("k=%d n=%d ", k, n) + order, n,
+                            Work{sizeof(float), 0}, [&] {
+                                    math::TopK topk(k);
+                                    for (int i = 0; i < n; i++)
+                                            topk.push(i, (*scores)[i]);
+                                    keep(topk.inserts());
+                            });
+                }
+        }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+        for (int i = 1; i < argc; i++)
+                filters.push_back(argv[i]);
+
+        std::printf("perf counters: %s\n",
+                    counters.available() ? "on" : "unavailable");
+        print_header();
+
+        auto pool = random_floats((256 << 20) / sizeof(float) + 1024, 1);
+        bench_distances(pool);
+        bench_pq(pool);
+        bench_kmeans(pool);
+        bench_topk();
+        // Last, since it rewrites the pool in place.
+        bench_normalize(pool);
+        return 0;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace spheni::bench {
+
+struct CounterValues {
+        uint64_t cycles = 0;
+        uint64_t instructions = 0;
+        uint64_t cache_misses = 0;
+};
+
+// Cycles, instructions and last-level cache misses of the calling thread,
+// read as one perf_event group. available() is false when the kernel or the
+// sandbox refuses the counters; start() and stop() then do nothing.
+class PerfCounters {
+      public:
+#if defined(__linux__)
+        PerfCounters() {
+                leader_ = open(PERF_COUNT_HW_CPU_CYCLES, -1);
+                if (leader_ < 0)
+                        return;
+                instructions_ = open(PERF_COUNT_HW_INSTRUCTIONS, leader_);
+                cache_misses_ = open(PERF_COUNT_HW_CACHE_MISSES, leader_);
+                if (instructions_ < 0 || cache_misses_ < 0)
+                        close_all();
+        }
+        ~PerfCounters() { close_all(); }
+        PerfCounters(const PerfCounters &) = delete;
+        PerfCounters &operator=(const PerfCounters &) = delete;
+
+        bool available() const { return leader_ >= 0; }
+
+        void start() {
+                if (!available())
+                        return;
+                ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+
+        CounterValues stop() {
+                CounterValues v;
+                if (!available())
+                        return v;
+                ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+                // PERF_FORMAT_GROUP: the event count, then one value per
+                // event in the order they were opened.
+                uint64_t buf[4] = {};
+                if (read(leader_, buf, sizeof(buf)) != sizeof(buf))
+                        return v;
+                v.cycles = buf[1];
+                v.instructions = buf[2];
+                v.cache_misses = buf[3];
+                return v;
+        }
+
+      private:
+        int leader_ = -1;
+        int instructions_ = -1;
+        int cache_misses_ = -1;
+
+        static int open(uint64_t config, int group) {
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = config;
+                attr.disabled = group < 0;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP;
+                return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                                    0);
+        }
+
+        void close_all() {
+                for (int *fd : {&cache_misses_, &instructions_, &leader_}) {
+                        if (*fd >= 0)
+                                ::close(*fd);
+                        *fd = -1;
+                }
+        }
+#else
+        bool available() const { return false; }
+        void start() {}
+        CounterValues stop() { return {}; }
+#endif
+};
+
+} // namespace spheni::bench
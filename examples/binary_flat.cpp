@@ -0,0 +1,50 @@
+#include "spheni.h"
+#include <cstdio>
+#include <numeric>
+#include <span>
+#include <vector>
+
+int main() {
+        const int dim = 768;
+        const int n = 10000;
+
+        std::vector<float> vecs(n * dim);
+        for (auto &x : vecs)
+                x = (float)rand() / RAND_MAX;
+
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+
+        spheni::BinaryFlatSpec spec;
+        spec.dim = dim;
+        spec.metric = spheni::Metric::Cosine;
+        spec.normalize = true;
+        spec.rotate = true;
+        spec.rerank = 4;
+
+        spheni::BinaryFlatIndex index(spec);
+        index.train(std::span<const float>(vecs));
+        index.add(ids, std::span<const float>(vecs));
+
+        // Reranking keeps every float vector next to its code, so the codes
+        // alone are not the index footprint.
+        size_t original = n * dim * sizeof(float);
+        size_t codes = index.code_bytes();
+        size_t total = index.compressed_bytes();
+
+        printf("Vectors: %d x dim %d\n", n, dim);
+        printf("Original: %zu KB\n", original / 1024);
+        printf("Codes: %zu KB (%.1fx smaller)\n", codes / 1024,
+               (float)original / codes);
+        printf("Rerank vectors: %zu KB\n", (total - codes) / 1024);
+        printf("Index total: %zu KB\n", total / 1024);
+
+        std::vector<float> query(vecs.begin(), vecs.begin() + dim);
+        auto hits = index.search(query, 5);
+        printf("\nTop 5 Results:\n");
+        for (const auto &h : hits) {
+                printf("ID: %lld | Score: %.4f\n", h.id, h.score);
+        }
+
+        return 0;
+}
@@ -0,0 +1,91 @@
+#include "spheni.h"
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Minimal client for the server protocol:
+// request int32 k, int32 dim, float[dim];
+// response int32 n, int64 latency_ns, n x (int64 id, float32 score).
+static long long query(int fd, const float *q, int dim, int k) {
+        int32_t header[2] = {k, dim};
+        send(fd, header, sizeof(header), 0);
+        send(fd, q, dim * sizeof(float), 0);
+
+        int32_t n;
+        int64_t latency;
+        recv(fd, &n, sizeof(n), MSG_WAITALL);
+        recv(fd, &latency, sizeof(latency), MSG_WAITALL);
+        for (int i = 0; i < n; i++) {
+                int64_t id;
+                float score;
+                recv(fd, &id, sizeof(id), MSG_WAITALL);
+                recv(fd, &score, sizeof(score), MSG_WAITALL);
+        }
+        return latency;
+}
+
+int main() {
+        const int dim = 128;
+        const int n = 10000;
+        const int clients = 8;
+        const int per_client = 50;
+
+        std::vector<float> vecs(n * dim);
+        for (auto &x : vecs)
+                x = (float)rand() / RAND_MAX;
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+
+        spheni::IVFPQSpec spec;
+        spec.dim = dim;
+        spec.nlist = 64;
+        spec.nprobe = 8;
+        spec.M = 16;
+
+        spheni::IVFPQIndex index(spec);
+        index.train(vecs);
+        index.add(ids, vecs);
+
+        spheni::ServerOptions options;
+        options.socket_path = "/tmp/spheni.sock";
+        options.window_us = 200;
+        spheni::SearchServer server(index, options);
+        if (!server.start()) {
+                printf("Could not listen on %s\n", options.socket_path.c_str());
+                return 1;
+        }
+
+        std::vector<long long> latency(clients, 0);
+        std::vector<std::thread> threads;
+        for (int c = 0; c < clients; c++) {
+                threads.emplace_back([&, c] {
+                        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                        sockaddr_un addr{};
+                        addr.sun_family = AF_UNIX;
+                        std::strcpy(addr.sun_path,
+                                    options.socket_path.c_str());
+                        connect(fd, (sockaddr *)&addr, sizeof(addr));
+                        for (int i = 0; i < per_client; i++)
+                                latency[c] += query(
+                                    fd, vecs.data() + (c * per_client + i) * dim,
+                                    dim, 10);
+                        close(fd);
+                });
+        }
+        for (auto &t : threads)
+                t.join();
+        server.stop();
+
+        const long long total =
+            std::accumulate(latency.begin(), latency.end(), 0LL);
+        printf("Served %d queries from %d clients\n", clients * per_client,
+               clients);
+        printf("Mean server latency: %.1f us\n",
+               total / 1e3 / (clients * per_client));
+        return 0;
+}
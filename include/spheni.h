@@ -1,25 +1,99 @@
 #pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <span>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace spheni::math {
+class MultiIndex;
+class MultiSequence;
 class ProductQuantizer;
-}
+class TopK;
+} // namespace spheni::math
 
 namespace spheni {
 
 enum class Metric { Cosine, L2 };
 
+// MultiIndex splits vectors in two halves, each with sqrt(nlist) centroids,
+// and uses every pair of half-centroids as a cell. nlist must be a square.
+enum class CoarseQuantizer { Flat, MultiIndex };
+
+enum class PageSize { Default, Huge2M, Huge1G };
+
+// Interleave spreads pages over all nodes, Bind keeps them on `node`, and
+// Partition binds each inverted list to a node in round-robin order (flat
+// storage is interleaved). On a single-node host placement is ignored.
+// Only IVFPQIndex::search_batch scans partitioned lists from the CPUs of
+// their node; search() and Search run on the calling thread wherever it is.
+enum class NumaPlacement { Default, Interleave, Bind, Partition };
+
+struct MemoryPolicy {
+        PageSize pages = PageSize::Default;
+        NumaPlacement numa = NumaPlacement::Default;
+        int node = 0;
+        std::size_t alignment = 64;
+
+        bool operator==(const MemoryPolicy &) const = default;
+};
+
+inline constexpr MemoryPolicy kDefaultMemoryPolicy{};
+
+void *allocate_storage(std::size_t bytes, const MemoryPolicy &policy);
+void free_storage(void *p, std::size_t bytes, const MemoryPolicy &policy);
+int numa_node_count();
+// Process-lifetime copy of `policy`, shared by every allocator using it.
+const MemoryPolicy *storage_policy(const MemoryPolicy &policy);
+
+// Allocator for index storage that follows a MemoryPolicy. It holds only a
+// pointer to the interned policy, so containers stay one word larger than
+// with std::allocator.
+template <class T> struct StorageAllocator {
+        using value_type = T;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        const MemoryPolicy *policy = &kDefaultMemoryPolicy;
+
+        StorageAllocator() = default;
+        explicit StorageAllocator(const MemoryPolicy &policy)
+            : policy(storage_policy(policy)) {}
+        template <class U>
+        StorageAllocator(const StorageAllocator<U> &other)
+            : policy(other.policy) {}
+
+        T *allocate(std::size_t n) {
+                return static_cast<T *>(
+                    allocate_storage(n * sizeof(T), *policy));
+        }
+        void deallocate(T *p, std::size_t n) {
+                free_storage(p, n * sizeof(T), *policy);
+        }
+        bool operator==(const StorageAllocator &) const = default;
+};
+
+template <class T> using StorageVector = std::vector<T, StorageAllocator<T>>;
+
 struct Spec {
         int dim;
         Metric metric = Metric::Cosine;
         bool normalize = true;
+        MemoryPolicy memory{};
 };
 
 struct IVFSpec : Spec {
         int nlist = 0;
         int nprobe = 1;
+        bool adaptive_nprobe = false;
+        int max_nprobe = 0;
+        float probe_gap_ratio = 0.0f;
 };
 
 struct PQFlatSpec : Spec {
@@ -32,6 +106,15 @@ struct IVFPQSpec : Spec {
         int nprobe = 8;
         int M = 8;
         int ksub = 256;
+        CoarseQuantizer coarse = CoarseQuantizer::Flat;
+        bool adaptive_nprobe = false;
+        int max_nprobe = 0;
+        float probe_gap_ratio = 0.0f;
+};
+
+struct BinaryFlatSpec : Spec {
+        bool rotate = true;
+        int rerank = 4;
 };
 
 struct Hit {
@@ -39,17 +122,87 @@ struct Hit {
         float score;
 };
 
+struct RebalanceOptions {
+        // Lists longer than split_ratio times the mean list length are split
+        // until no part exceeds that length.
+        float split_ratio = 4.0f;
+        // Lists shorter than merge_ratio times the mean are dissolved into
+        // the nearest remaining cells.
+        float merge_ratio = 0.1f;
+};
+
+struct RebalanceReport {
+        int splits = 0;
+        int merges = 0;
+        long long moved = 0;
+};
+
+// Work done by one search call. Phase times stay zero unless the library is
+// built with SPHENI_TIMERS.
+struct SearchStats {
+        long long cells_probed = 0;
+        long long codes_scanned = 0;
+        long long heap_pushes = 0;
+        long long lut_builds = 0;
+        long long coarse_ns = 0;
+        long long lut_ns = 0;
+        long long scan_ns = 0;
+        long long heap_ns = 0;
+};
+
+// Power-of-two buckets: bucket 0 counts zeros, bucket b counts values in
+// [2^(b-1), 2^b).
+struct Histogram {
+        static constexpr int kBuckets = 64;
+        std::array<long long, kBuckets> counts{};
+        long long total = 0;
+        long long sum = 0;
+        long long max = 0;
+
+        void add(long long value);
+        // Upper edge of the bucket holding the p-th quantile, p in [0, 1].
+        long long quantile(double p) const;
+};
+
+// Aggregates SearchStats across queries and threads for the host to read.
+class StatsAggregator {
+      public:
+        struct Snapshot {
+                long long queries = 0;
+                Histogram cells_probed, codes_scanned, heap_pushes, lut_builds;
+                Histogram coarse_ns, lut_ns, scan_ns, heap_ns;
+        };
+
+        void record(const SearchStats &stats);
+        Snapshot snapshot() const;
+        void reset();
+
+      private:
+        mutable std::mutex mu_;
+        Snapshot data_;
+};
+
 class FlatIndex {
       public:
         explicit FlatIndex(const Spec &spec);
         void add(std::span<const long long> ids, std::span<const float> vecs);
+        void merge(const FlatIndex &other);
         std::vector<Hit> search(std::span<const float> query, int k) const;
+        std::vector<Hit> range_search(std::span<const float> query,
+                                      float radius) const;
+        std::vector<std::vector<Hit>>
+        range_search_batch(std::span<const float> queries,
+                           float radius) const;
         long long size() const { return ids_.size(); }
+        std::span<const long long> ids() const { return ids_; }
+        // Vectors as stored, normalized if the spec asks for it.
+        std::span<const float> vectors() const { return vecs_; }
 
       private:
         Spec spec_;
         std::vector<long long> ids_;
-        std::vector<float> vecs_;
+        StorageVector<float> vecs_;
+        float (*dist_)(const float *, const float *, int);
         bool should_normalize() const;
         float score_f32(const float *q, const float *v) const;
 };
@@ -60,17 +213,41 @@ class IVFIndex {
         void train(std::span<const long long> ids,
                    std::span<const float> vectors);
         void add(std::span<const long long> ids, std::span<const float> vecs);
-        std::vector<Hit> search(std::span<const float> query, int k) const;
+        std::vector<Hit> search(std::span<const float> query, int k,
+                                SearchStats *stats = nullptr) const;
+        std::vector<Hit> range_search(std::span<const float> query,
+                                      float radius) const;
+        std::vector<std::vector<Hit>>
+        range_search_batch(std::span<const float> queries,
+                           float radius) const;
         long long size() const { return ntotal_; }
 
+        // Shard construction: copy the centroids of a trained index into an
+        // empty one, add a shard to each copy, then merge the copies. Both
+        // return false, leaving this index unchanged, unless the indexes
+        // are distinct, trained, and agree on dim, nlist, metric,
+        // normalization and (for merge) centroids.
+        bool copy_quantizer(const IVFIndex &trained);
+        bool merge(const IVFIndex &other);
+
+        std::vector<long long> list_sizes() const;
+        RebalanceReport rebalance(const RebalanceOptions &options = {});
+
       private:
         IVFSpec spec_;
         std::vector<float> centroids_;
         std::vector<FlatIndex> cells_;
+        std::vector<float> radii_;
+        float (*l2_)(const float *, const float *, int);
         long long ntotal_ = 0;
         bool trained_ = false;
         bool should_normalize() const;
+        bool has_score_bound() const;
+        bool compatible(const IVFIndex &other) const;
         int nearest_centroid(const float *vec) const;
+        float cell_score_bound(int cell, float centroid_dist) const;
+        void update_radius(int cell, const float *vec);
+        void insert(int cell, long long id, const float *vec);
 };
 
 class PQFlatIndex {
@@ -80,10 +257,18 @@ class PQFlatIndex {
 
         void train(std::span<const float> vecs);
         void add(std::span<const long long> ids, std::span<const float> vecs);
-        std::vector<Hit> search(std::span<const float> query, int k) const;
+        std::vector<Hit> search(std::span<const float> query, int k,
+                                SearchStats *stats = nullptr) const;
+        std::vector<Hit> range_search(std::span<const float> query,
+                                      float radius) const;
+        std::vector<std::vector<Hit>>
+        range_search_batch(std::span<const float> queries,
+                           float radius) const;
         long long size() const { return ids_.size(); }
 
-        size_t compressed_bytes() const { return codes_.size(); }
+        size_t compressed_bytes() const {
+                return codes_.size() + inv_norms_.size();
+        }
         size_t uncompressed_bytes() const {
                 return ids_.size() * spec_.dim * sizeof(float);
         }
@@ -92,36 +277,362 @@ class PQFlatIndex {
         PQFlatSpec spec_;
         std::unique_ptr<math::ProductQuantizer> pq_;
         std::vector<long long> ids_;
-        std::vector<uint8_t> codes_;
+        StorageVector<uint8_t> codes_;
+        StorageVector<uint8_t> inv_norms_;
         bool trained_ = false;
         bool should_normalize() const;
+        bool corrects_norms() const;
+        template <class Sink>
+        void scan(std::span<const float> query, SearchStats *stats,
+                  Sink &&sink) const;
+};
+
+// Coarse centroids and PQ codebooks learned by IVF-PQ training. Immutable
+// once trained, so a single instance can back many indexes.
+class IVFPQQuantizer {
+      public:
+        static std::shared_ptr<const IVFPQQuantizer>
+        train(const IVFPQSpec &spec, std::span<const float> vecs,
+              std::span<const float> centroids = {});
+        ~IVFPQQuantizer();
+
+        int nlist() const { return nlist_; }
+        int dim() const { return dim_; }
+        // Flat centroids, or for a multi-index its two half codebooks.
+        std::span<const float> centroids() const { return centroids_; }
+        // Points each cell's codes are residuals of, when a rebalance has
+        // moved centroids away from them. Empty when they are the centroids.
+        std::span<const float> bases() const { return bases_; }
+        const math::ProductQuantizer &pq() const { return *pq_; }
+        const math::MultiIndex *multi_index() const { return multi_.get(); }
+        size_t bytes() const;
+        // Whether `spec` has this quantizer's shapes, metric, normalization
+        // and coarse quantizer type.
+        bool compatible(const IVFPQSpec &spec) const;
+        // Same codebooks, shared rather than copied, over other centroids
+        // (for a multi-index, other half codebooks) and optionally bases.
+        std::shared_ptr<const IVFPQQuantizer>
+        with_centroids(std::vector<float> centroids,
+                       std::vector<float> bases = {}) const;
+
+      private:
+        IVFPQQuantizer(int dim, Metric metric, bool normalize,
+                       std::vector<float> centroids,
+                       std::shared_ptr<const math::ProductQuantizer> pq,
+                       std::shared_ptr<const math::MultiIndex> multi,
+                       std::vector<float> bases = {});
+        int dim_;
+        int nlist_;
+        Metric metric_;
+        bool normalize_;
+        std::vector<float> centroids_;
+        std::vector<float> bases_;
+        std::shared_ptr<const math::ProductQuantizer> pq_;
+        std::shared_ptr<const math::MultiIndex> multi_;
 };
 
 class IVFPQIndex {
       public:
         explicit IVFPQIndex(const IVFPQSpec &spec);
+        // Starts trained, sharing `quantizer` with any other index built on
+        // it. Its parameters must match `spec`.
+        IVFPQIndex(const IVFPQSpec &spec,
+                   std::shared_ptr<const IVFPQQuantizer> quantizer);
         ~IVFPQIndex();
         void train(std::span<const float> vecs);
+        void train(std::span<const float> vecs,
+                   std::span<const float> centroids);
         void add(std::span<const long long> ids, std::span<const float> vecs);
-        std::vector<Hit> search(std::span<const float> query, int k) const;
+        std::vector<Hit> search(std::span<const float> query, int k,
+                                SearchStats *stats = nullptr) const;
+        std::vector<std::vector<Hit>>
+        search_batch(std::span<const float> queries, int k) const;
+        std::vector<Hit> range_search(std::span<const float> query,
+                                      float radius) const;
+        std::vector<std::vector<Hit>>
+        range_search_batch(std::span<const float> queries,
+                           float radius) const;
         long long size() const { return ntotal_; }
+        int dim() const { return spec_.dim; }
+
+        // Resumable search. Each step scans a bounded number of codes, so
+        // an event loop can interleave queries and stop at a deadline with
+        // the best hits found so far. The index must outlive the search and
+        // must not be modified while it runs. A search can be moved, say into
+        // a container of in-flight queries, between steps.
+        class Search {
+              public:
+                Search(const IVFPQIndex &index, std::span<const float> query,
+                       int k, SearchStats *stats = nullptr);
+                ~Search();
+                Search(Search &&) noexcept;
+                Search &operator=(Search &&) noexcept;
+
+                // Budget, in codes, charged for each cell a step visits.
+                static constexpr long long kCellVisitCost = 16;
+
+                bool step(long long max_codes);
+                bool done() const { return done_; }
+                std::vector<Hit> results() const;
+                long long codes_scanned() const { return scanned_; }
+
+              private:
+                const IVFPQIndex *index_;
+                SearchStats *stats_;
+                std::vector<float> q_;
+                std::vector<std::pair<float, int>> ranked_;
+                std::unique_ptr<math::MultiSequence> sequence_;
+                std::vector<float> table_;
+                std::vector<float> residual_;
+                std::vector<float> centroid_buf_;
+                std::vector<float> dists_;
+                std::unique_ptr<math::TopK> topk_;
+                int nprobe_ = 0;
+                int max_probe_ = 0;
+                float qnorm_ = 0.0f;
+                float coarse_ = 0.0f;
+                int p_ = 0;
+                int cell_ = -1;
+                int i0_ = 0;
+                bool open_ = false;
+                bool done_ = false;
+                long long scanned_ = 0;
+
+                bool open_cell();
+        };
+        std::span<const float> centroids() const {
+                return quantizer_ ? quantizer_->centroids()
+                                  : std::span<const float>();
+        }
+        std::shared_ptr<const IVFPQQuantizer> quantizer() const {
+                return quantizer_;
+        }
+        void set_nprobe(int nprobe) { spec_.nprobe = nprobe; }
+
+        // Shard construction, as for IVFIndex. The quantizer is shared
+        // rather than copied, and codes are concatenated without
+        // re-encoding, so both indexes need the same quantizer. Both return
+        // false, leaving this index unchanged, when the quantizer does not
+        // fit this index's spec.
+        bool copy_quantizer(const IVFPQIndex &trained);
+        bool merge(const IVFPQIndex &other);
+
+        std::vector<long long> list_sizes() const;
+        // Gives this index its own centroids. The PQ codebooks stay shared.
+        RebalanceReport rebalance(const RebalanceOptions &options = {});
 
         size_t compressed_bytes() const;
         size_t uncompressed_bytes() const;
 
       private:
         IVFPQSpec spec_;
-        std::unique_ptr<math::ProductQuantizer> pq_;
-        std::vector<float> centroids_;
+        std::shared_ptr<const IVFPQQuantizer> quantizer_;
+        // Views into quantizer_, kept to spare the scan loops an indirection.
+        const math::ProductQuantizer *pq_ = nullptr;
+        const float *centroids_ = nullptr;
+        const float *bases_ = nullptr;
+        const math::MultiIndex *multi_ = nullptr;
         struct Cell {
-                std::vector<long long> ids;
-                std::vector<uint8_t> codes;
+                explicit Cell(const MemoryPolicy &policy)
+                    : ids(StorageAllocator<long long>(policy)),
+                      codes(StorageAllocator<uint8_t>(policy)),
+                      inv_norms(StorageAllocator<uint8_t>(policy)) {}
+                StorageVector<long long> ids;
+                StorageVector<uint8_t> codes;
+                StorageVector<uint8_t> inv_norms;
         };
         std::vector<Cell> cells_;
+        std::vector<float> radii_;
+        std::vector<float> max_inv_norms_;
+        float (*l2_)(const float *, const float *, int);
+        float (*dot_)(const float *, const float *, int);
 
         long long ntotal_ = 0;
-        bool trained_ = false;
         bool should_normalize() const;
+        bool corrects_norms() const;
+        void use_quantizer(std::shared_ptr<const IVFPQQuantizer> quantizer);
         int nearest_centroid(const float *vec) const;
+        const float *cell_centroid(int cell, float *buf) const;
+        const float *cell_base(int cell, float *buf) const;
+        float base_dist(const float *q, const float *base,
+                        float centroid_dist) const;
+        std::vector<std::pair<float, int>> rank_cells(const float *query,
+                                                      int n) const;
+        std::vector<std::pair<float, int>>
+        start_ranking(const float *query, int n,
+                      std::unique_ptr<math::MultiSequence> &sequence) const;
+        static bool
+        rank_through(int p, std::vector<std::pair<float, int>> &ranked,
+                     math::MultiSequence *sequence);
+        float cell_score_bound(int cell, float centroid_dist, float coarse,
+                               float qnorm) const;
+        void append(int cell, long long id, const float *vec);
+        void reconstruct(int cell, int i, float *vec) const;
+        void score_codes(const Cell &cell, int i0, int nb,
+                         const std::vector<float> &table, float coarse,
+                         float *out) const;
+        void scan_group(int c, const std::vector<int> &group, const float *qs,
+                        const std::vector<std::vector<float>> &ip_tables,
+                        std::vector<math::TopK> &topks) const;
+};
+
+class BinaryFlatIndex {
+      public:
+        explicit BinaryFlatIndex(const BinaryFlatSpec &spec);
+
+        void train(std::span<const float> vecs);
+        void add(std::span<const long long> ids, std::span<const float> vecs);
+        std::vector<Hit> search(std::span<const float> query, int k) const;
+        long long size() const { return ids_.size(); }
+
+        size_t code_bytes() const { return codes_.size() * sizeof(uint64_t); }
+        // Codes plus the float vectors kept for reranking.
+        size_t compressed_bytes() const {
+                return code_bytes() + vecs_.size() * sizeof(float);
+        }
+        size_t uncompressed_bytes() const {
+                return ids_.size() * spec_.dim * sizeof(float);
+        }
+
+      private:
+        BinaryFlatSpec spec_;
+        int words_;
+        std::vector<long long> ids_;
+        StorageVector<uint64_t> codes_;
+        StorageVector<float> vecs_;
+        std::vector<float> mean_;
+        std::vector<float> rotation_;
+        int (*hamming_)(const uint64_t *, const uint64_t *, int);
+        float (*dist_)(const float *, const float *, int);
+        bool trained_ = false;
+        bool should_normalize() const;
+        void encode_into(const float *vec, uint64_t *code) const;
+};
+
+struct CacheOptions {
+        std::size_t capacity = 4096;
+        int shards = 16;
+        // Normalize queries before keying, so q and 2q share an entry. Only
+        // set this when the wrapped index normalizes queries itself: without
+        // normalization, L2 distances and the inner products of cosine (MIPS)
+        // depend on the query's scale, and the cache would serve one query
+        // the hits and scores of the other.
+        bool normalize = false;
+        // Zero keys on the exact query; a positive step rounds components
+        // to multiples of it, so near-identical queries share an entry.
+        float quantization = 0.0f;
+};
+
+// Bounded LRU cache of search results, keyed on the query signature and k.
+// Entries are split over independently locked shards.
+class ResultCache {
+      public:
+        explicit ResultCache(const CacheOptions &options = {});
+        ~ResultCache();
+
+        bool lookup(std::span<const float> query, int k,
+                    std::vector<Hit> &hits);
+        // Results computed while the cache was at `version` are dropped if
+        // it has been invalidated since.
+        void insert(std::span<const float> query, int k,
+                    const std::vector<Hit> &hits, uint64_t version);
+        void invalidate();
+        uint64_t version() const;
+
+        long long hits() const;
+        long long misses() const;
+
+      private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+};
+
+// Puts a ResultCache in front of any index. `add` goes through the wrapper
+// so that it invalidates the cache.
+template <class Index> class CachedIndex {
+      public:
+        explicit CachedIndex(Index &index, const CacheOptions &options = {})
+            : index_(index), cache_(options) {}
+
+        std::vector<Hit> search(std::span<const float> query, int k) {
+                std::vector<Hit> hits;
+                if (cache_.lookup(query, k, hits))
+                        return hits;
+                const uint64_t version = cache_.version();
+                hits = index_.search(query, k);
+                cache_.insert(query, k, hits, version);
+                return hits;
+        }
+
+        void add(std::span<const long long> ids, std::span<const float> vecs) {
+                index_.add(ids, vecs);
+                cache_.invalidate();
+        }
+
+        Index &index() { return index_; }
+        ResultCache &cache() { return cache_; }
+
+      private:
+        Index &index_;
+        ResultCache cache_;
+};
+
+struct TuneOptions {
+        int k = 10;
+        float target_recall = 0.9f;
+        // Zero leaves a budget unbounded.
+        double max_latency_us = 0.0;
+        std::size_t max_memory_bytes = 0;
+        // Empty grids are derived from the sample size and dimensionality.
+        std::vector<int> nlists;
+        std::vector<int> Ms;
+        std::vector<int> nprobes;
+};
+
+struct TunePoint {
+        int nlist = 0;
+        int M = 0;
+        int nprobe = 0;
+        float recall = 0.0f;
+        double latency_us = 0.0;
+        std::size_t memory_bytes = 0;
+};
+
+struct TuneResult {
+        IVFPQSpec spec;
+        // Whether `best` reaches the recall target within both budgets.
+        bool met = false;
+        TunePoint best;
+        // Measured points not beaten on recall, latency and memory at once.
+        std::vector<TunePoint> frontier;
+};
+
+// Picks nlist, M and nprobe for `base` by building indexes over `sample` and
+// scoring `queries` against exact FlatIndex results.
+TuneResult tune_ivfpq(const IVFPQSpec &base, std::span<const float> sample,
+                      std::span<const float> queries,
+                      const TuneOptions &options = {});
+
+struct ServerOptions {
+        std::string socket_path;
+        int window_us = 200;
+        int max_batch = 64;
+        // Requests asking for more hits get this many. Must be positive.
+        int max_k = 1024;
+};
+
+// Serves IVFPQIndex searches over a unix socket. Queries arriving within
+// `window_us` of each other are answered by one search_batch call. Only
+// built on Unix platforms.
+class SearchServer {
+      public:
+        SearchServer(const IVFPQIndex &index, const ServerOptions &options);
+        ~SearchServer();
+        bool start();
+        void stop();
+
+      private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
 };
 } // namespace spheni
@@ -0,0 +1,137 @@
+#include "math/math.h"
+#include "spheni.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <list>
+#include <unordered_map>
+
+namespace spheni {
+
+namespace {
+
+struct Entry {
+        uint64_t hash;
+        std::vector<uint32_t> key;
+        uint64_t version;
+        std::vector<Hit> hits;
+};
+
+// Each shard is an LRU list, most recent first, indexed by key hash.
+struct Shard {
+        std::mutex mu;
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> map;
+};
+
+uint64_t hash_key(const std::vector<uint32_t> &key) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (uint32_t w : key) {
+                h ^= w;
+                h *= 0x100000001b3ull;
+        }
+        return h ^ (h >> 32);
+}
+
+} // namespace
+
+struct ResultCache::Impl {
+        CacheOptions options;
+        std::size_t shard_capacity;
+        std::vector<Shard> shards;
+        std::atomic<uint64_t> version{0};
+        std::atomic<long long> hits{0};
+        std::atomic<long long> misses{0};
+
+        explicit Impl(const CacheOptions &options)
+            : options(options),
+              shard_capacity(std::max<std::size_t>(
+                  1, options.capacity / std::max(options.shards, 1))),
+              shards(std::max(options.shards, 1)) {}
+
+        std::vector<uint32_t> signature(std::span<const float> query,
+                                        int k) const;
+};
+
+// k followed by one word per component: the float bits of the (normalized)
+// query, or its components rounded to the quantization step.
+std::vector<uint32_t>
+ResultCache::Impl::signature(std::span<const float> query, int k) const {
+        std::vector<float> q(query.begin(), query.end());
+        if (options.normalize)
+                math::kernels::normalize(q.data(), (int)q.size());
+
+        std::vector<uint32_t> key(q.size() + 1);
+        key[0] = static_cast<uint32_t>(k);
+        const float step = options.quantization;
+        for (size_t d = 0; d < q.size(); d++) {
+                // Adding 0.0f folds -0.0f into +0.0f.
+                key[d + 1] =
+                    step > 0.0f
+                        ? static_cast<uint32_t>(std::lround(q[d] / step))
+                        : std::bit_cast<uint32_t>(q[d] + 0.0f);
+        }
+        return key;
+}
+
+ResultCache::ResultCache(const CacheOptions &options)
+    : impl_(std::make_unique<Impl>(options)) {}
+
+ResultCache::~ResultCache() = default;
+
+bool ResultCache::lookup(std::span<const float> query, int k,
+                         std::vector<Hit> &hits) {
+        const auto key = impl_->signature(query, k);
+        const uint64_t h = hash_key(key);
+        Shard &shard = impl_->shards[h % impl_->shards.size()];
+        {
+                std::lock_guard<std::mutex> lock(shard.mu);
+                auto it = shard.map.find(h);
+                if (it != shard.map.end() && it->second->key == key &&
+                    it->second->version == impl_->version.load()) {
+                        shard.lru.splice(shard.lru.begin(), shard.lru,
+                                         it->second);
+                        hits = it->second->hits;
+                        impl_->hits++;
+                        return true;
+                }
+        }
+        impl_->misses++;
+        return false;
+}
+
+void ResultCache::insert(std::span<const float> query, int k,
+                         const std::vector<Hit> &hits, uint64_t version) {
+        if (version != impl_->version.load())
+                return;
+        auto key = impl_->signature(query, k);
+        const uint64_t h = hash_key(key);
+        Shard &shard = impl_->shards[h % impl_->shards.size()];
+
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.map.find(h);
+        if (it != shard.map.end()) {
+                shard.lru.erase(it->second);
+                shard.map.erase(it);
+        }
+        shard.lru.push_front(Entry{h, std::move(key), version, hits});
+        shard.map[h] = shard.lru.begin();
+        while (shard.lru.size() > impl_->shard_capacity) {
+                shard.map.erase(shard.lru.back().hash);
+                shard.lru.pop_back();
+        }
+}
+
+// Entries from older versions are never served and age out of the LRU
+// lists, so invalidation does not need to visit the shards.
+void ResultCache::invalidate() { impl_->version++; }
+
+uint64_t ResultCache::version() const { return impl_->version.load(); }
+
+long long ResultCache::hits() const { return impl_->hits.load(); }
+
+long long ResultCache::misses() const { return impl_->misses.load(); }
+
+} // namespace spheni
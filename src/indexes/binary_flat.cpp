@@ -0,0 +1,130 @@
+#include "math/binary.h"
+#include "math/math.h"
+#include "math/topk.h"
+#include "spheni.h"
+
+#include <cassert>
+
+namespace spheni {
+
+BinaryFlatIndex::BinaryFlatIndex(const BinaryFlatSpec &spec)
+    : spec_(spec), words_(math::binary_words(spec.dim)),
+      codes_(StorageAllocator<uint64_t>(spec.memory)),
+      vecs_(StorageAllocator<float>(spec.memory)),
+      hamming_(math::kernels::select_hamming(words_)) {
+        dist_ = spec_.metric == Metric::L2
+                    ? math::kernels::select_l2(spec_.dim)
+                    : math::kernels::select_dot(spec_.dim);
+}
+
+bool BinaryFlatIndex::should_normalize() const { return spec_.normalize; }
+
+void BinaryFlatIndex::train(std::span<const float> vecs) {
+        const int dim = spec_.dim;
+        const int n = vecs.size() / dim;
+        const bool norm = should_normalize();
+        // The mean is undefined without data, as k-means is for the others.
+        assert(n > 0);
+
+        // Sign bits only carry information about data centered at the origin.
+        std::vector<float> tmp(dim);
+        mean_.assign(dim, 0.0f);
+        for (int i = 0; i < n; i++) {
+                const float *src = vecs.data() + i * dim;
+                if (norm) {
+                        std::copy(src, src + dim, tmp.begin());
+                        math::kernels::normalize(tmp.data(), dim);
+                        src = tmp.data();
+                }
+                for (int d = 0; d < dim; d++)
+                        mean_[d] += src[d];
+        }
+        for (int d = 0; d < dim; d++)
+                mean_[d] /= n;
+
+        if (spec_.rotate)
+                rotation_ = math::random_rotation(dim);
+        trained_ = true;
+}
+
+void BinaryFlatIndex::encode_into(const float *vec, uint64_t *code) const {
+        const int dim = spec_.dim;
+        std::vector<float> centered(dim);
+        for (int d = 0; d < dim; d++)
+                centered[d] = vec[d] - mean_[d];
+        if (!spec_.rotate) {
+                math::pack_signs(centered.data(), dim, code);
+                return;
+        }
+        std::vector<float> rotated(dim);
+        for (int d = 0; d < dim; d++)
+                rotated[d] = math::kernels::dot(rotation_.data() + d * dim,
+                                                centered.data(), dim);
+        math::pack_signs(rotated.data(), dim, code);
+}
+
+void BinaryFlatIndex::add(std::span<const long long> ids,
+                          std::span<const float> vecs) {
+        assert(trained_);
+        const int dim = spec_.dim;
+        const int n = vecs.size() / dim;
+        const bool norm = should_normalize();
+
+        ids_.insert(ids_.end(), ids.begin(), ids.end());
+        const size_t offset = codes_.size();
+        codes_.resize(offset + (size_t)n * words_);
+
+        std::vector<float> tmp(dim);
+        for (int i = 0; i < n; i++) {
+                const float *src = vecs.data() + i * dim;
+                if (norm) {
+                        std::copy(src, src + dim, tmp.begin());
+                        math::kernels::normalize(tmp.data(), dim);
+                        src = tmp.data();
+                }
+                encode_into(src, codes_.data() + offset + (size_t)i * words_);
+                if (spec_.rerank > 0)
+                        vecs_.insert(vecs_.end(), src, src + dim);
+        }
+}
+
+std::vector<Hit> BinaryFlatIndex::search(std::span<const float> query,
+                                         int k) const {
+        const int dim = spec_.dim;
+        const bool norm = should_normalize();
+        std::vector<float> tmp;
+        const float *q = query.data();
+        if (norm) {
+                tmp.assign(query.begin(), query.end());
+                math::kernels::normalize(tmp.data(), dim);
+                q = tmp.data();
+        }
+
+        std::vector<uint64_t> qcode(words_);
+        encode_into(q, qcode.data());
+
+        // Without reranking, scores are negated Hamming distances. With it,
+        // the closest rerank * k codes are rescored against stored vectors;
+        // their positions stand in for ids until then.
+        const int n = (int)ids_.size();
+        const bool rerank = spec_.rerank > 0;
+        math::TopK coarse(rerank ? spec_.rerank * k : k);
+        for (int i = 0; i < n; i++) {
+                const int h = hamming_(qcode.data(),
+                                       codes_.data() + (size_t)i * words_,
+                                       words_);
+                coarse.push(rerank ? i : ids_[i], -(float)h);
+        }
+        if (!rerank)
+                return coarse.take_sorted();
+
+        math::TopK topk(k);
+        for (const Hit &c : coarse.take_sorted()) {
+                const float *v = vecs_.data() + c.id * dim;
+                const float d = dist_(q, v, dim);
+                topk.push(ids_[c.id], spec_.metric == Metric::L2 ? -d : d);
+        }
+        return topk.take_sorted();
+}
+
+} // namespace spheni
@@ -4,7 +4,12 @@
 
 namespace spheni {
 
-FlatIndex::FlatIndex(const Spec &spec) : spec_(spec) {}
+FlatIndex::FlatIndex(const Spec &spec)
+    : spec_(spec), vecs_(StorageAllocator<float>(spec.memory)) {
+        dist_ = spec_.metric == Metric::L2
+                    ? math::kernels::select_l2(spec_.dim)
+                    : math::kernels::select_dot(spec_.dim);
+}
 
 bool FlatIndex::should_normalize() const {
         return spec_.normalize; // && spec_.metric == Metric::Cosine;
@@ -13,9 +18,9 @@ bool FlatIndex::should_normalize() const {
 float FlatIndex::score_f32(const float *q, const float *v) const {
         switch (spec_.metric) {
         case Metric::Cosine:
-                return math::kernels::dot(q, v, spec_.dim);
+                return dist_(q, v, spec_.dim);
         case Metric::L2:
-                return -math::kernels::l2_squared(q, v, spec_.dim);
+                return -dist_(q, v, spec_.dim);
         }
         return 0.0f;
 }
@@ -42,6 +47,12 @@ void FlatIndex::add(std::span<const long long> ids,
         }
 }
 
+// Stored vectors are already normalized, so they are appended as they are.
+void FlatIndex::merge(const FlatIndex &other) {
+        ids_.insert(ids_.end(), other.ids_.begin(), other.ids_.end());
+        vecs_.insert(vecs_.end(), other.vecs_.begin(), other.vecs_.end());
+}
+
 std::vector<Hit> FlatIndex::search(std::span<const float> query, int k) const {
         const bool normalize_query = should_normalize();
         std::vector<float> tmp;
@@ -58,4 +69,42 @@ std::vector<Hit> FlatIndex::search(std::span<const float> query, int k) const {
         return topk.take_sorted();
 }
 
+std::vector<Hit> FlatIndex::range_search(std::span<const float> query,
+                                         float radius) const {
+        return range_search_batch(query, radius)[0];
+}
+
+// Stored vectors are scanned in blocks, and every query is scored against a
+// block while it is still in cache.
+std::vector<std::vector<Hit>>
+FlatIndex::range_search_batch(std::span<const float> queries,
+                              float radius) const {
+        const int dim = spec_.dim;
+        const int nq = queries.size() / dim;
+        std::vector<float> qs(queries.begin(), queries.end());
+        if (should_normalize())
+                for (int i = 0; i < nq; i++)
+                        math::kernels::normalize(qs.data() + i * dim, dim);
+
+        const float min_score = math::range_min_score(spec_.metric, radius);
+        const int n = (int)ids_.size();
+        const int block = 256;
+        std::vector<std::vector<Hit>> results(nq);
+        for (int i0 = 0; i0 < n; i0 += block) {
+                const int i1 = std::min(n, i0 + block);
+                for (int qi = 0; qi < nq; qi++) {
+                        const float *q = qs.data() + qi * dim;
+                        for (int i = i0; i < i1; i++) {
+                                const float s =
+                                    score_f32(q, vecs_.data() + i * dim);
+                                if (s >= min_score)
+                                        results[qi].push_back({ids_[i], s});
+                        }
+                }
+        }
+        for (auto &hits : results)
+                math::sort_hits(hits);
+        return results;
+}
+
 } // namespace spheni
@@ -1,29 +1,68 @@
 #include "math/kmeans.h"
 #include "math/math.h"
+#include "math/probe.h"
+#include "math/rebalance.h"
 #include "math/topk.h"
+#include "memory/numa.h"
 #include "spheni.h"
+#include "stats/timer.h"
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <limits>
 
 namespace spheni {
 
-IVFIndex::IVFIndex(const IVFSpec &spec) : spec_(spec) {
+IVFIndex::IVFIndex(const IVFSpec &spec)
+    : spec_(spec), l2_(math::kernels::select_l2(spec.dim)) {
         cells_.reserve(spec_.nlist);
-        for (int i = 0; i < spec_.nlist; i++)
-                cells_.emplace_back(spec_);
+        for (int i = 0; i < spec_.nlist; i++) {
+                Spec cell_spec = spec_;
+                cell_spec.memory = memory::list_policy(spec_.memory, i);
+                cells_.emplace_back(cell_spec);
+        }
+        radii_.assign(spec_.nlist, 0.0f);
 }
 
-bool IVFIndex::should_normalize() const {
-        return spec_.normalize && spec_.metric == Metric::Cosine;
+// Cells are FlatIndexes, which normalize whenever the spec asks for it, so
+// centroids and queries must too or the coarse ranking and cell radii would
+// live in a different space from the stored vectors.
+bool IVFIndex::should_normalize() const { return spec_.normalize; }
+
+// Cell scores can be bounded from centroid distances only when they are
+// derived from L2 distance: either L2 itself or cosine on unit vectors.
+bool IVFIndex::has_score_bound() const {
+        return spec_.metric == Metric::L2 || spec_.normalize;
+}
+
+// Best score any vector of a cell can reach, from the squared query-centroid
+// distance and the cell radius. Only valid when has_score_bound().
+float IVFIndex::cell_score_bound(int cell, float centroid_dist) const {
+        const float lb = math::cell_lower_bound(centroid_dist, radii_[cell]);
+        return spec_.metric == Metric::L2 ? -lb : 1.0f - lb / 2;
+}
+
+// Tracks the largest centroid distance of the vectors stored in a cell, as
+// the cell's FlatIndex stores them.
+void IVFIndex::update_radius(int cell, const float *vec) {
+        const int dim = spec_.dim;
+        std::vector<float> tmp;
+        if (spec_.normalize) {
+                tmp.assign(vec, vec + dim);
+                math::kernels::normalize(tmp.data(), dim);
+                vec = tmp.data();
+        }
+        const float r = std::sqrt(math::kernels::l2_squared(
+            vec, centroids_.data() + cell * dim, dim));
+        radii_[cell] = std::max(radii_[cell], r);
 }
 
 int IVFIndex::nearest_centroid(const float *vec) const {
         float best = std::numeric_limits<float>::max();
         int idx = 0;
         for (int c = 0; c < spec_.nlist; c++) {
-                float d = math::kernels::l2_squared(
-                    vec, centroids_.data() + c * spec_.dim, spec_.dim);
+                float d = l2_(vec, centroids_.data() + c * spec_.dim,
+                              spec_.dim);
                 if (d < best) {
                         best = d;
                         idx = c;
@@ -57,11 +96,18 @@ void IVFIndex::train(std::span<const long long> ids,
                 cells_[assignments[i]].add(
                     std::span<const long long>(&ids[i], 1),
                     std::span<const float>(vecs.data() + i * dim, dim));
+                update_radius(assignments[i], vecs.data() + i * dim);
                 ++ntotal_;
         }
         trained_ = true;
 }
 
+void IVFIndex::insert(int cell, long long id, const float *vec) {
+        cells_[cell].add(std::span<const long long>(&id, 1),
+                         std::span<const float>(vec, spec_.dim));
+        update_radius(cell, vec);
+}
+
 void IVFIndex::add(std::span<const long long> ids,
                    std::span<const float> vecs) {
         assert(trained_);
@@ -81,14 +127,151 @@ void IVFIndex::add(std::span<const long long> ids,
                         math::kernels::normalize(tmp.data(), dim);
                         v = tmp.data();
                 }
-                cells_[nearest_centroid(v)].add(
-                    std::span<const long long>(&ids[i], 1),
-                    std::span<const float>(v, dim));
+                insert(nearest_centroid(v), ids[i], v);
                 ++ntotal_;
         }
 }
 
-std::vector<Hit> IVFIndex::search(std::span<const float> query, int k) const {
+// Stored vectors and centroids only share a space when the metric and
+// normalization match, so those must agree as well as the shapes.
+bool IVFIndex::compatible(const IVFIndex &other) const {
+        return other.spec_.dim == spec_.dim &&
+               other.spec_.nlist == spec_.nlist &&
+               other.spec_.metric == spec_.metric &&
+               other.spec_.normalize == spec_.normalize;
+}
+
+bool IVFIndex::copy_quantizer(const IVFIndex &trained) {
+        if (&trained == this || !trained.trained_ || !compatible(trained))
+                return false;
+        centroids_ = trained.centroids_;
+        trained_ = true;
+        return true;
+}
+
+bool IVFIndex::merge(const IVFIndex &other) {
+        if (&other == this || !trained_ || !other.trained_ ||
+            !compatible(other) || centroids_ != other.centroids_)
+                return false;
+        for (int c = 0; c < spec_.nlist; c++) {
+                cells_[c].merge(other.cells_[c]);
+                radii_[c] = std::max(radii_[c], other.radii_[c]);
+        }
+        ntotal_ += other.ntotal_;
+        return true;
+}
+
+std::vector<long long> IVFIndex::list_sizes() const {
+        std::vector<long long> sizes(spec_.nlist);
+        for (int c = 0; c < spec_.nlist; c++)
+                sizes[c] = cells_[c].size();
+        return sizes;
+}
+
+// Cells keep exact vectors, normalized like the centroids, so moved vectors
+// are split and reassigned as they are stored. Only the dissolved and split
+// lists are touched.
+RebalanceReport IVFIndex::rebalance(const RebalanceOptions &options) {
+        assert(trained_);
+        RebalanceReport report;
+        if (ntotal_ == 0)
+                return report;
+
+        const int dim = spec_.dim;
+        const double mean = (double)ntotal_ / spec_.nlist;
+        const long long merge_below = (long long)(options.merge_ratio * mean);
+        const long long split_at = std::max<long long>(
+            2, (long long)std::ceil(options.split_ratio * mean));
+
+        auto take = [&](int c, math::CellGroup &g) {
+                const auto ids = cells_[c].ids();
+                const auto vecs = cells_[c].vectors();
+                g.ids.assign(ids.begin(), ids.end());
+                g.vecs.assign(vecs.begin(), vecs.end());
+        };
+        auto cell_spec = [&](int c) {
+                Spec s = spec_;
+                s.memory = memory::list_policy(spec_.memory, c);
+                return s;
+        };
+
+        // A kept list that changes index moves to the node of its new index.
+        auto relocate = [&](int from, int to) {
+                if (memory::list_node(spec_.memory, from) ==
+                    memory::list_node(spec_.memory, to))
+                        return std::move(cells_[from]);
+                FlatIndex moved(cell_spec(to));
+                moved.merge(cells_[from]);
+                return moved;
+        };
+
+        std::vector<bool> keep(spec_.nlist);
+        int kept = 0;
+        for (int c = 0; c < spec_.nlist; c++) {
+                keep[c] = cells_[c].size() >= merge_below;
+                kept += keep[c];
+        }
+        if (kept == 0)
+                keep.assign(spec_.nlist, true);
+
+        // Same plan as IVFPQIndex::rebalance: dissolve short lists into the
+        // nearest remaining cells and split long ones in place.
+        math::CellGroup loose{-1, {}, {}};
+        std::vector<math::CellGroup> groups;
+        std::vector<float> centroids;
+        std::vector<FlatIndex> cells;
+        std::vector<float> radii;
+        for (int c = 0; c < spec_.nlist; c++) {
+                math::CellGroup g{(int)cells.size(), {}, {}};
+                if (!keep[c]) {
+                        take(c, g);
+                        loose.ids.insert(loose.ids.end(), g.ids.begin(),
+                                         g.ids.end());
+                        loose.vecs.insert(loose.vecs.end(), g.vecs.begin(),
+                                          g.vecs.end());
+                        report.merges++;
+                        continue;
+                }
+                centroids.insert(centroids.end(),
+                                 centroids_.begin() + c * dim,
+                                 centroids_.begin() + (c + 1) * dim);
+                if (cells_[c].size() < split_at) {
+                        cells.push_back(relocate(c, cells.size()));
+                        radii.push_back(radii_[c]);
+                        continue;
+                }
+                take(c, g);
+                groups.push_back(std::move(g));
+                cells.emplace_back(cell_spec(cells.size()));
+                radii.push_back(0.0f);
+        }
+        report.splits = math::split_groups(groups, centroids, dim, split_at);
+
+        const int nlist = centroids.size() / dim;
+        for (int c = cells.size(); c < nlist; c++)
+                cells.emplace_back(cell_spec(c));
+        radii.resize(nlist, 0.0f);
+
+        cells_ = std::move(cells);
+        radii_ = std::move(radii);
+        centroids_ = std::move(centroids);
+        spec_.nlist = nlist;
+
+        for (const auto &g : groups) {
+                for (size_t i = 0; i < g.ids.size(); i++)
+                        insert(g.cell, g.ids[i], g.vecs.data() + i * dim);
+                report.moved += g.ids.size();
+        }
+        for (size_t i = 0; i < loose.ids.size(); i++) {
+                const float *v = loose.vecs.data() + i * dim;
+                insert(nearest_centroid(v), loose.ids[i], v);
+        }
+        report.moved += loose.ids.size();
+        return report;
+}
+
+std::vector<Hit> IVFIndex::search(std::span<const float> query, int k,
+                                  SearchStats *stats) const {
         const int dim = spec_.dim;
         const bool normalize_query = should_normalize();
         std::vector<float> tmp;
@@ -99,23 +282,99 @@ std::vector<Hit> IVFIndex::search(std::span<const float> query, int k) const {
                 q = tmp.data();
         }
 
-        std::vector<std::pair<float, int>> dists(spec_.nlist);
-        for (int c = 0; c < spec_.nlist; c++)
-                dists[c] = {math::kernels::l2_squared(
-                                q, centroids_.data() + c * dim, dim),
-                            c};
-
         const int nprobe = std::min(spec_.nprobe, spec_.nlist);
-        std::partial_sort(dists.begin(), dists.begin() + nprobe, dists.end());
+        const int max_probe =
+            spec_.adaptive_nprobe
+                ? math::probe_limit(nprobe, spec_.max_nprobe, spec_.nlist)
+                : nprobe;
+        std::vector<std::pair<float, int>> dists;
+        {
+                stats::ScopedTimer timer(stats, &SearchStats::coarse_ns);
+                dists = math::rank_cells(l2_, q, centroids_.data(),
+                                         spec_.nlist, dim, max_probe);
+        }
+        const bool bounded = has_score_bound();
 
         math::TopK topk(k);
-        for (int p = 0; p < nprobe; p++) {
-                auto hits = cells_[dists[p].second].search(
-                    std::span<const float>(q, dim), k);
+        for (int p = 0; p < max_probe; p++) {
+                if (p >= nprobe) {
+                        if (math::gap_exceeded(dists, p, spec_.probe_gap_ratio))
+                                break;
+                        if (bounded && topk.full() &&
+                            cell_score_bound(dists[p].second,
+                                             dists[p].first) <= topk.worst())
+                                continue;
+                }
+                const FlatIndex &cell = cells_[dists[p].second];
+                if (stats) {
+                        stats->cells_probed++;
+                        stats->codes_scanned += cell.size();
+                }
+                std::vector<Hit> hits;
+                {
+                        stats::ScopedTimer timer(stats, &SearchStats::scan_ns);
+                        hits = cell.search(std::span<const float>(q, dim), k);
+                }
+                stats::ScopedTimer timer(stats, &SearchStats::heap_ns);
                 for (auto &h : hits)
                         topk.push(h.id, h.score);
         }
+        if (stats)
+                stats->heap_pushes += topk.inserts();
         return topk.take_sorted();
 }
 
+// Probes the same cells as search, skipping any whose bound falls short of
+// the radius, wherever it ranks.
+std::vector<Hit> IVFIndex::range_search(std::span<const float> query,
+                                        float radius) const {
+        const int dim = spec_.dim;
+        std::vector<float> tmp;
+        const float *q = query.data();
+        if (should_normalize()) {
+                tmp.assign(query.begin(), query.end());
+                math::kernels::normalize(tmp.data(), dim);
+                q = tmp.data();
+        }
+
+        const int nprobe = std::min(spec_.nprobe, spec_.nlist);
+        const int max_probe =
+            spec_.adaptive_nprobe
+                ? math::probe_limit(nprobe, spec_.max_nprobe, spec_.nlist)
+                : nprobe;
+        const auto dists = math::rank_cells(l2_, q, centroids_.data(),
+                                            spec_.nlist, dim, max_probe);
+        const bool bounded = has_score_bound();
+        const float min_score = math::range_min_score(spec_.metric, radius);
+
+        std::vector<Hit> out;
+        for (int p = 0; p < max_probe; p++) {
+                if (p >= nprobe &&
+                    math::gap_exceeded(dists, p, spec_.probe_gap_ratio))
+                        break;
+                const int c = dists[p].second;
+                if (cells_[c].size() == 0 ||
+                    (bounded &&
+                     cell_score_bound(c, dists[p].first) < min_score))
+                        continue;
+                const auto hits = cells_[c].range_search(
+                    std::span<const float>(q, dim), radius);
+                out.insert(out.end(), hits.begin(), hits.end());
+        }
+        math::sort_hits(out);
+        return out;
+}
+
+std::vector<std::vector<Hit>>
+IVFIndex::range_search_batch(std::span<const float> queries,
+                             float radius) const {
+        const int dim = spec_.dim;
+        const int nq = queries.size() / dim;
+        std::vector<std::vector<Hit>> results(nq);
+        for (int i = 0; i < nq; i++)
+                results[i] =
+                    range_search(queries.subspan(i * dim, dim), radius);
+        return results;
+}
+
 } // namespace spheni
@@ -1,31 +1,179 @@
 #include "math/kmeans.h"
 #include "math/math.h"
+#include "math/multi_index.h"
 #include "math/pq.h"
+#include "math/probe.h"
+#include "math/rebalance.h"
 #include "math/topk.h"
+#include "memory/numa.h"
 #include "spheni.h"
+#include "stats/timer.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <limits>
+#include <map>
+#include <thread>
 
 namespace spheni {
 
-IVFPQIndex::IVFPQIndex(const IVFPQSpec &spec) : spec_(spec) {
-        pq_ = std::make_unique<math::ProductQuantizer>(spec_.dim, spec_.M,
-                                                       spec_.ksub);
-        cells_.resize(spec_.nlist);
+IVFPQQuantizer::IVFPQQuantizer(
+    int dim, Metric metric, bool normalize, std::vector<float> centroids,
+    std::shared_ptr<const math::ProductQuantizer> pq,
+    std::shared_ptr<const math::MultiIndex> multi, std::vector<float> bases)
+    : dim_(dim), metric_(metric), normalize_(normalize),
+      centroids_(std::move(centroids)), bases_(std::move(bases)),
+      pq_(std::move(pq)), multi_(std::move(multi)) {
+        nlist_ = multi_ ? multi_->nlist() : (int)(centroids_.size() / dim_);
+}
+
+IVFPQQuantizer::~IVFPQQuantizer() = default;
+
+// With `centroids` given, the coarse k-means step is skipped and only the
+// product quantizer is trained, on residuals to those centroids. For a
+// multi-index they are its two half codebooks.
+std::shared_ptr<const IVFPQQuantizer>
+IVFPQQuantizer::train(const IVFPQSpec &spec, std::span<const float> vecs,
+                      std::span<const float> centroids) {
+        const int n = vecs.size() / spec.dim;
+        const int dim = spec.dim;
+
+        std::vector<float> work;
+        std::span<const float> train_vecs = vecs;
+        if (spec.normalize) {
+                work.assign(vecs.begin(), vecs.end());
+                for (int i = 0; i < n; i++)
+                        math::kernels::normalize(work.data() + i * dim, dim);
+                train_vecs = std::span<const float>(work.data(), work.size());
+        }
+        std::vector<float> coarse;
+        std::vector<int> assignments;
+        std::shared_ptr<math::MultiIndex> multi;
+        if (spec.coarse == CoarseQuantizer::MultiIndex) {
+                const int k = (int)std::lround(std::sqrt((double)spec.nlist));
+                assert(k * k == spec.nlist);
+                multi = std::make_shared<math::MultiIndex>(dim, k);
+                if (centroids.empty())
+                        multi->train(train_vecs);
+                else
+                        multi->set_codebooks(centroids);
+                const auto cb = multi->codebooks();
+                coarse.assign(cb.begin(), cb.end());
+                assignments.resize(n);
+                for (int i = 0; i < n; i++)
+                        assignments[i] =
+                            multi->assign(train_vecs.data() + i * dim);
+        } else {
+                math::clustering::KMeans coarse_km(spec.nlist, dim);
+                if (centroids.empty()) {
+                        coarse = coarse_km.fit(train_vecs);
+                } else {
+                        assert(centroids.size() == (size_t)spec.nlist * dim);
+                        coarse.assign(centroids.begin(), centroids.end());
+                }
+                assignments = coarse_km.predict(train_vecs, coarse);
+        }
+
+        std::vector<float> residuals(n * dim);
+        std::vector<float> buf(dim);
+        for (int i = 0; i < n; i++) {
+                const float *vec = train_vecs.data() + i * dim;
+                const float *centroid = buf.data();
+                if (multi)
+                        multi->centroid(assignments[i], buf.data());
+                else
+                        centroid = coarse.data() + assignments[i] * dim;
+                float *res = residuals.data() + i * dim;
+                for (int d = 0; d < dim; d++)
+                        res[d] = vec[d] - centroid[d];
+        }
+        auto pq = std::make_shared<math::ProductQuantizer>(
+            dim, spec.M, spec.ksub, spec.memory);
+        pq->train(std::span<const float>(residuals.data(), residuals.size()));
+        return std::shared_ptr<const IVFPQQuantizer>(
+            new IVFPQQuantizer(dim, spec.metric, spec.normalize,
+                               std::move(coarse), std::move(pq),
+                               std::move(multi)));
+}
+
+std::shared_ptr<const IVFPQQuantizer>
+IVFPQQuantizer::with_centroids(std::vector<float> centroids,
+                               std::vector<float> bases) const {
+        assert(bases.empty() || (!multi_ && bases.size() == centroids.size()));
+        std::shared_ptr<math::MultiIndex> multi;
+        if (multi_) {
+                multi = std::make_shared<math::MultiIndex>(
+                    dim_, (int)(centroids.size() / dim_));
+                multi->set_codebooks(centroids);
+        }
+        return std::shared_ptr<const IVFPQQuantizer>(
+            new IVFPQQuantizer(dim_, metric_, normalize_, std::move(centroids),
+                               pq_, std::move(multi), std::move(bases)));
+}
+
+size_t IVFPQQuantizer::bytes() const {
+        return (centroids_.size() + bases_.size() + pq_->codebooks().size()) *
+               sizeof(float);
+}
+
+// Metric, normalization and coarse quantizer type change what the codes
+// mean, so they must match as well as the shapes.
+bool IVFPQQuantizer::compatible(const IVFPQSpec &spec) const {
+        return spec.nlist == nlist() && spec.dim == dim_ &&
+               spec.M == pq_->M() && spec.ksub == pq_->ksub() &&
+               spec.metric == metric_ && spec.normalize == normalize_ &&
+               (spec.coarse == CoarseQuantizer::MultiIndex) == (bool)multi_;
+}
+
+IVFPQIndex::IVFPQIndex(const IVFPQSpec &spec)
+    : spec_(spec), l2_(math::kernels::select_l2(spec.dim)),
+      dot_(math::kernels::select_dot(spec.dim)) {
+        // Unbounded adaptive probing would walk every one of a multi-index's
+        // cells whenever the gap ratio does not stop it.
+        assert(spec_.coarse != CoarseQuantizer::MultiIndex ||
+               !spec_.adaptive_nprobe || spec_.max_nprobe > 0);
+        cells_.reserve(spec_.nlist);
+        for (int i = 0; i < spec_.nlist; i++)
+                cells_.emplace_back(memory::list_policy(spec_.memory, i));
+        radii_.assign(spec_.nlist, 0.0f);
+        max_inv_norms_.assign(spec_.nlist, 0.0f);
+}
+
+IVFPQIndex::IVFPQIndex(const IVFPQSpec &spec,
+                       std::shared_ptr<const IVFPQQuantizer> quantizer)
+    : IVFPQIndex(spec) {
+        use_quantizer(std::move(quantizer));
 }
 
 IVFPQIndex::~IVFPQIndex() = default;
 
 bool IVFPQIndex::should_normalize() const { return spec_.normalize; }
 
+// Cosine on unit vectors rescales each inner product by the inverse norm of
+// the reconstruction c + r, which PQ does not keep at 1.
+bool IVFPQIndex::corrects_norms() const {
+        return spec_.metric == Metric::Cosine && should_normalize();
+}
+
+void IVFPQIndex::use_quantizer(
+    std::shared_ptr<const IVFPQQuantizer> quantizer) {
+        assert(quantizer && quantizer->compatible(spec_));
+        quantizer_ = std::move(quantizer);
+        pq_ = &quantizer_->pq();
+        centroids_ = quantizer_->centroids().data();
+        bases_ = quantizer_->bases().empty() ? nullptr
+                                             : quantizer_->bases().data();
+        multi_ = quantizer_->multi_index();
+}
+
 int IVFPQIndex::nearest_centroid(const float *vec) const {
+        if (multi_)
+                return multi_->assign(vec);
         float best = std::numeric_limits<float>::max();
         int idx = 0;
         for (int c = 0; c < spec_.nlist; ++c) {
-                float d = math::kernels::l2_squared(
-                    vec, centroids_.data() + c * spec_.dim, spec_.dim);
+                float d = l2_(vec, centroids_ + c * spec_.dim, spec_.dim);
                 if (d < best) {
                         best = d;
                         idx = c;
@@ -34,46 +182,84 @@ int IVFPQIndex::nearest_centroid(const float *vec) const {
         return idx;
 }
 
-void IVFPQIndex::train(std::span<const float> vecs) {
-        const int n = vecs.size() / spec_.dim;
-        const int dim = spec_.dim;
-        const bool norm = should_normalize();
+// Centroid of `cell`. A multi-index does not store its cells' centroids,
+// so it builds the centroid in `buf`.
+const float *IVFPQIndex::cell_centroid(int cell, float *buf) const {
+        if (!multi_)
+                return centroids_ + cell * spec_.dim;
+        multi_->centroid(cell, buf);
+        return buf;
+}
 
-        std::vector<float> work;
-        std::span<const float> train_vecs = vecs;
-        if (norm) {
-                work.assign(vecs.begin(), vecs.end());
-                for (int i = 0; i < n; i++)
-                        math::kernels::normalize(work.data() + i * dim, dim);
-                train_vecs = std::span<const float>(work.data(), work.size());
-        }
-        math::clustering::KMeans coarse_km(spec_.nlist, dim);
-        centroids_ = coarse_km.fit(train_vecs);
+// Point the codes of `cell` are residuals of: its centroid, unless a
+// rebalance split the cell's list and kept the codes of the old one.
+const float *IVFPQIndex::cell_base(int cell, float *buf) const {
+        if (bases_)
+                return bases_ + cell * spec_.dim;
+        return cell_centroid(cell, buf);
+}
 
-        auto assignments = coarse_km.predict(train_vecs, centroids_);
-        std::vector<float> residuals(n * dim);
-        for (int i = 0; i < n; i++) {
-                const float *vec = train_vecs.data() + i * dim;
-                const float *centroid =
-                    centroids_.data() + assignments[i] * dim;
-                float *res = residuals.data() + i * dim;
-                for (int d = 0; d < dim; d++)
-                        res[d] = vec[d] - centroid[d];
+// Squared distance from `q` to a cell's base, which the L2 score bound
+// needs. `centroid_dist` is the distance ranking found to its centroid.
+float IVFPQIndex::base_dist(const float *q, const float *base,
+                            float centroid_dist) const {
+        if (!bases_ || spec_.metric == Metric::Cosine)
+                return centroid_dist;
+        return l2_(q, base, spec_.dim);
+}
+
+// Cells by squared L2 distance to the query; only the first `n` are ranked.
+std::vector<std::pair<float, int>>
+IVFPQIndex::rank_cells(const float *query, int n) const {
+        if (multi_)
+                return multi_->rank(query, n);
+        return math::rank_cells(l2_, query, centroids_, spec_.nlist, spec_.dim,
+                                n);
+}
+
+// Ranks the first `n` cells. A multi-index ranks none up front and hands
+// them out through `sequence` as rank_through() asks for them, so adaptive
+// probing never ranks the millions of cells it does not reach.
+std::vector<std::pair<float, int>> IVFPQIndex::start_ranking(
+    const float *query, int n,
+    std::unique_ptr<math::MultiSequence> &sequence) const {
+        if (!multi_)
+                return rank_cells(query, n);
+        sequence = std::make_unique<math::MultiSequence>(*multi_, query);
+        return {};
+}
+
+// Extends `ranked` until it holds entry `p`. Returns false when there is no
+// such cell.
+bool IVFPQIndex::rank_through(int p,
+                              std::vector<std::pair<float, int>> &ranked,
+                              math::MultiSequence *sequence) {
+        std::pair<float, int> next;
+        while ((int)ranked.size() <= p) {
+                if (!sequence || !sequence->next(next))
+                        return false;
+                ranked.push_back(next);
         }
-        pq_->train(std::span<const float>(residuals.data(), residuals.size()));
-        trained_ = true;
+        return true;
+}
+
+void IVFPQIndex::train(std::span<const float> vecs) {
+        train(vecs, {});
+}
+
+void IVFPQIndex::train(std::span<const float> vecs,
+                       std::span<const float> centroids) {
+        use_quantizer(IVFPQQuantizer::train(spec_, vecs, centroids));
 }
 
 void IVFPQIndex::add(std::span<const long long> ids,
                      std::span<const float> vecs) {
-        assert(trained_);
+        assert(quantizer_);
         const int n = vecs.size() / spec_.dim;
         const int dim = spec_.dim;
         const bool norm = should_normalize();
 
         std::vector<float> temp(dim);
-        std::vector<float> residual(dim);
-
         for (int i = 0; i < n; i++) {
                 const float *src = vecs.data() + i * dim;
                 if (norm) {
@@ -81,75 +267,537 @@ void IVFPQIndex::add(std::span<const long long> ids,
                         math::kernels::normalize(temp.data(), dim);
                         src = temp.data();
                 }
+                append(nearest_centroid(src), ids[i], src);
+                ntotal_++;
+        }
+}
 
-                const int cell_index = nearest_centroid(src);
-                const float *centroid = centroids_.data() + cell_index * dim;
+// Encodes `vec` as a residual to the base of `cell` and stores it there.
+void IVFPQIndex::append(int cell_index, long long id, const float *vec) {
+        const int dim = spec_.dim;
+        std::vector<float> buf(dim);
+        const float *c = cell_base(cell_index, buf.data());
+        std::vector<float> residual(dim);
+        for (int d = 0; d < dim; d++)
+                residual[d] = vec[d] - c[d];
+
+        auto code = pq_->encode_one(residual.data());
 
+        Cell &cell = cells_[cell_index];
+        cell.ids.push_back(id);
+        cell.codes.insert(cell.codes.end(), code.begin(), code.end());
+        radii_[cell_index] = std::max(
+            radii_[cell_index], std::sqrt(pq_->code_norm_sq(code.data())));
+        if (corrects_norms()) {
+                pq_->decode_one(code.data(), residual.data());
                 for (int d = 0; d < dim; d++)
-                        residual[d] = src[d] - centroid[d];
+                        residual[d] += c[d];
+                const uint8_t inv = math::quantize_inv_norm(
+                    1.0f /
+                    std::sqrt(dot_(residual.data(), residual.data(), dim)));
+                cell.inv_norms.push_back(inv);
+                max_inv_norms_[cell_index] =
+                    std::max(max_inv_norms_[cell_index],
+                             math::inv_norm_levels()[inv]);
+        }
+}
 
-                auto code = pq_->encode_one(residual.data());
+// Vector i of a cell as its code reconstructs it: base plus residual.
+void IVFPQIndex::reconstruct(int cell, int i, float *vec) const {
+        const int dim = spec_.dim;
+        pq_->decode_one(cells_[cell].codes.data() + i * pq_->M(), vec);
+        std::vector<float> buf(dim);
+        const float *c = cell_base(cell, buf.data());
+        for (int d = 0; d < dim; d++)
+                vec[d] += c[d];
+}
 
-                Cell &cell = cells_[cell_index];
-                cell.ids.push_back(ids[i]);
-                cell.codes.insert(cell.codes.end(), code.begin(), code.end());
-                ntotal_++;
+bool IVFPQIndex::copy_quantizer(const IVFPQIndex &trained) {
+        if (!trained.quantizer_ || !trained.quantizer_->compatible(spec_))
+                return false;
+        use_quantizer(trained.quantizer_);
+        return true;
+}
+
+bool IVFPQIndex::merge(const IVFPQIndex &other) {
+        if (!quantizer_ || !other.quantizer_ ||
+            !quantizer_->compatible(other.spec_) ||
+            !other.quantizer_->compatible(spec_))
+                return false;
+        if (quantizer_ != other.quantizer_ &&
+            !(std::ranges::equal(centroids(), other.centroids()) &&
+              std::ranges::equal(quantizer_->bases(),
+                                 other.quantizer_->bases()) &&
+              std::ranges::equal(pq_->codebooks(), other.pq_->codebooks())))
+                return false;
+        for (int c = 0; c < spec_.nlist; c++) {
+                Cell &cell = cells_[c];
+                const Cell &src = other.cells_[c];
+                cell.ids.insert(cell.ids.end(), src.ids.begin(),
+                                src.ids.end());
+                cell.codes.insert(cell.codes.end(), src.codes.begin(),
+                                  src.codes.end());
+                cell.inv_norms.insert(cell.inv_norms.end(),
+                                      src.inv_norms.begin(),
+                                      src.inv_norms.end());
+                radii_[c] = std::max(radii_[c], other.radii_[c]);
+                max_inv_norms_[c] =
+                    std::max(max_inv_norms_[c], other.max_inv_norms_[c]);
         }
+        ntotal_ += other.ntotal_;
+        return true;
 }
 
-std::vector<Hit> IVFPQIndex::search(std::span<const float> query, int k) const {
+std::vector<long long> IVFPQIndex::list_sizes() const {
+        std::vector<long long> sizes(spec_.nlist);
+        for (int c = 0; c < spec_.nlist; c++)
+                sizes[c] = cells_[c].ids.size();
+        return sizes;
+}
+
+// Raw vectors are not kept, so split lists keep their codes: each part of a
+// split remembers the centroid its codes are residuals of, and only its
+// probing centroid moves. Vectors of dissolved lists join cells with other
+// centroids and are re-encoded from their reconstructions. Only the
+// dissolved and split lists are touched.
+RebalanceReport IVFPQIndex::rebalance(const RebalanceOptions &options) {
+        assert(quantizer_);
+        RebalanceReport report;
+        // Multi-index cells are fixed by the product of the half codebooks.
+        if (ntotal_ == 0 || multi_)
+                return report;
+
         const int dim = spec_.dim;
-        const bool norm = should_normalize();
+        const double mean = (double)ntotal_ / spec_.nlist;
+        const long long merge_below = (long long)(options.merge_ratio * mean);
+        const long long split_at = std::max<long long>(
+            2, (long long)std::ceil(options.split_ratio * mean));
+
+        auto take = [&](int c, math::CellGroup &g) {
+                const int size = (int)cells_[c].ids.size();
+                g.vecs.resize((size_t)size * dim);
+                for (int i = 0; i < size; i++)
+                        reconstruct(c, i, g.vecs.data() + (size_t)i * dim);
+                g.ids.assign(cells_[c].ids.begin(), cells_[c].ids.end());
+        };
+        // Split groups carry (list, position) in place of ids, so that their
+        // parts can take the codes from the list afterwards.
+        auto take_positions = [&](int c, math::CellGroup &g) {
+                take(c, g);
+                for (size_t i = 0; i < g.ids.size(); i++)
+                        g.ids[i] = (long long)c << 32 | (long long)i;
+        };
+
+        // A kept list that changes index moves to the node of its new index,
+        // so that partitioned lists still sit where list_node() says.
+        auto relocate = [&](int from, int to) {
+                if (memory::list_node(spec_.memory, from) ==
+                    memory::list_node(spec_.memory, to))
+                        return std::move(cells_[from]);
+                Cell moved(memory::list_policy(spec_.memory, to));
+                moved.ids.assign(cells_[from].ids.begin(),
+                                 cells_[from].ids.end());
+                moved.codes.assign(cells_[from].codes.begin(),
+                                   cells_[from].codes.end());
+                moved.inv_norms.assign(cells_[from].inv_norms.begin(),
+                                       cells_[from].inv_norms.end());
+                return moved;
+        };
+
+        std::vector<bool> keep(spec_.nlist);
+        int kept = 0;
+        for (int c = 0; c < spec_.nlist; c++) {
+                keep[c] = (long long)cells_[c].ids.size() >= merge_below;
+                kept += keep[c];
+        }
+        if (kept == 0)
+                keep.assign(spec_.nlist, true);
+
+        // Short lists are dissolved, and their vectors go to the nearest
+        // remaining cell once the centroids are final. Long lists are
+        // emptied, and their codes are placed in the cells produced by
+        // splitting them.
+        math::CellGroup loose{-1, {}, {}};
+        std::vector<math::CellGroup> groups;
+        std::vector<float> centroids, bases;
+        std::vector<Cell> cells;
+        std::vector<float> radii, max_inv_norms;
+        for (int c = 0; c < spec_.nlist; c++) {
+                math::CellGroup g{(int)cells.size(), {}, {}};
+                if (!keep[c]) {
+                        take(c, g);
+                        loose.ids.insert(loose.ids.end(), g.ids.begin(),
+                                         g.ids.end());
+                        loose.vecs.insert(loose.vecs.end(), g.vecs.begin(),
+                                          g.vecs.end());
+                        report.merges++;
+                        continue;
+                }
+                centroids.insert(centroids.end(), centroids_ + c * dim,
+                                 centroids_ + (c + 1) * dim);
+                const float *base = cell_base(c, nullptr);
+                bases.insert(bases.end(), base, base + dim);
+                if ((long long)cells_[c].ids.size() < split_at) {
+                        cells.push_back(relocate(c, (int)cells.size()));
+                        radii.push_back(radii_[c]);
+                        max_inv_norms.push_back(max_inv_norms_[c]);
+                        continue;
+                }
+                take_positions(c, g);
+                groups.push_back(std::move(g));
+                cells.emplace_back(
+                    memory::list_policy(spec_.memory, (int)cells.size()));
+                radii.push_back(0.0f);
+                max_inv_norms.push_back(0.0f);
+        }
+        report.splits = math::split_groups(groups, centroids, dim, split_at);
+
+        const int nlist = centroids.size() / dim;
+        for (int c = cells.size(); c < nlist; c++)
+                cells.emplace_back(memory::list_policy(spec_.memory, c));
+        radii.resize(nlist, 0.0f);
+        max_inv_norms.resize(nlist, 0.0f);
+        bases.resize((size_t)nlist * dim);
+
+        const float *levels = math::inv_norm_levels();
         const int M = pq_->M();
-        const int nprobe = std::min(spec_.nprobe, spec_.nlist);
+        for (const auto &g : groups) {
+                if (g.ids.empty())
+                        continue;
+                const int src = g.ids[0] >> 32;
+                const float *base = cell_base(src, nullptr);
+                std::copy(base, base + dim, bases.begin() + g.cell * dim);
+                const Cell &from = cells_[src];
+                Cell &to = cells[g.cell];
+                for (long long id : g.ids) {
+                        const int i = id & 0xffffffffLL;
+                        const uint8_t *code = from.codes.data() + i * M;
+                        to.ids.push_back(from.ids[i]);
+                        to.codes.insert(to.codes.end(), code, code + M);
+                        radii[g.cell] =
+                            std::max(radii[g.cell],
+                                     std::sqrt(pq_->code_norm_sq(code)));
+                        if (from.inv_norms.empty())
+                                continue;
+                        to.inv_norms.push_back(from.inv_norms[i]);
+                        max_inv_norms[g.cell] =
+                            std::max(max_inv_norms[g.cell],
+                                     levels[from.inv_norms[i]]);
+                }
+                report.moved += g.ids.size();
+        }
+
+        cells_ = std::move(cells);
+        radii_ = std::move(radii);
+        max_inv_norms_ = std::move(max_inv_norms);
+        spec_.nlist = nlist;
+        if (bases == centroids)
+                bases.clear();
+        use_quantizer(quantizer_->with_centroids(std::move(centroids),
+                                                 std::move(bases)));
 
-        std::vector<float> temp;
-        const float *q = query.data();
-        if (norm) {
-                temp.assign(query.begin(), query.end());
-                math::kernels::normalize(temp.data(), dim);
-                q = temp.data();
+        for (size_t i = 0; i < loose.ids.size(); i++) {
+                const float *v = loose.vecs.data() + i * dim;
+                append(nearest_centroid(v), loose.ids[i], v);
         }
+        report.moved += loose.ids.size();
+        return report;
+}
 
-        std::vector<std::pair<float, int>> cell_dists(spec_.nlist);
-        for (int c = 0; c < spec_.nlist; c++)
-                cell_dists[c] = {math::kernels::l2_squared(
-                                     q, centroids_.data() + c * dim, dim),
-                                 c};
+std::vector<Hit> IVFPQIndex::search(std::span<const float> query, int k,
+                                    SearchStats *stats) const {
+        Search search(*this, query, k, stats);
+        search.step(std::numeric_limits<long long>::max());
+        return search.results();
+}
 
-        std::partial_sort(cell_dists.begin(), cell_dists.begin() + nprobe,
-                          cell_dists.end());
-        // auto table = pq_->compute_distance_table(q);
-        math::TopK topk(k);
+IVFPQIndex::Search::Search(const IVFPQIndex &index,
+                           std::span<const float> query, int k,
+                           SearchStats *stats)
+    : index_(&index), stats_(stats), q_(query.begin(), query.end()),
+      topk_(std::make_unique<math::TopK>(k)) {
+        const IVFPQSpec &spec = index_->spec_;
+        const int dim = spec.dim;
+        if (index_->should_normalize())
+                math::kernels::normalize(q_.data(), dim);
 
-        std::vector<float> residual(dim);
+        nprobe_ = std::min(spec.nprobe, spec.nlist);
+        max_probe_ =
+            spec.adaptive_nprobe
+                ? math::probe_limit(nprobe_, spec.max_nprobe, spec.nlist)
+                : nprobe_;
+        {
+                stats::ScopedTimer timer(stats_, &SearchStats::coarse_ns);
+                ranked_ = index_->start_ranking(q_.data(), max_probe_,
+                                               sequence_);
+        }
 
-        for (int p = 0; p < nprobe; p++) {
-                const int cell_index = cell_dists[p].second;
-                const Cell &cell = cells_[cell_index];
-                if (cell.ids.empty())
-                        continue;
+        residual_.resize(dim);
+        centroid_buf_.resize(dim);
+        dists_.resize(math::ProductQuantizer::kScanBlock);
 
-                const float *centroid = centroids_.data() + cell_index * dim;
-                for (int d = 0; d < dim; d++)
-                        residual[d] = q[d] - centroid[d];
+        // Cosine scores <q, c + r> = <q, c> + <q, r>: the residual term comes
+        // from a single inner-product table per query and the coarse term is
+        // added once per cell. L2 needs a table per query residual.
+        if (spec.metric == Metric::Cosine) {
+                stats::ScopedTimer timer(stats_, &SearchStats::lut_ns);
+                table_ = index_->pq_->precompute_ip_table(q_.data());
+                qnorm_ = std::sqrt(index_->dot_(q_.data(), q_.data(), dim));
+                if (stats_)
+                        stats_->lut_builds++;
+        }
+}
+
+IVFPQIndex::Search::~Search() = default;
+IVFPQIndex::Search::Search(Search &&) noexcept = default;
+IVFPQIndex::Search &
+IVFPQIndex::Search::operator=(Search &&) noexcept = default;
 
-                auto table = pq_->precompute_table(residual.data());
+// Best score any code of a cell can reach. No stored residual is longer
+// than the cell radius: |(q - c) - r| >= |q - c| - |r| and
+// <q, r> <= |q||r|.
+float IVFPQIndex::cell_score_bound(int cell, float centroid_dist,
+                                   float coarse, float qnorm) const {
+        const float radius = radii_[cell];
+        float best = spec_.metric == Metric::Cosine
+                         ? coarse + qnorm * radius
+                         : -math::cell_lower_bound(centroid_dist, radius);
+        if (corrects_norms())
+                best *= best > 0.0f ? max_inv_norms_[cell]
+                                    : math::inv_norm_levels()[0];
+        return best;
+}
+
+// Moves to the next probed cell and prepares its scan. Returns false when
+// the cell is skipped or the search is over.
+bool IVFPQIndex::Search::open_cell() {
+        const IVFPQSpec &spec = index_->spec_;
+        const int dim = spec.dim;
+        const float *q = q_.data();
+        if (p_ >= max_probe_ ||
+            !rank_through(p_, ranked_, sequence_.get()) ||
+            (p_ >= nprobe_ &&
+             math::gap_exceeded(ranked_, p_, spec.probe_gap_ratio))) {
+                done_ = true;
+                return false;
+        }
+        const int p = p_++;
+        cell_ = ranked_[p].second;
+        const Cell &cell = index_->cells_[cell_];
+        if (cell.ids.empty())
+                return false;
+
+        const bool ip = spec.metric == Metric::Cosine;
+        const float *base = index_->cell_base(cell_, centroid_buf_.data());
+        coarse_ = ip ? index_->dot_(q, base, dim) : 0.0f;
+        if (p >= nprobe_ && topk_->full() &&
+            index_->cell_score_bound(
+                cell_, index_->base_dist(q, base, ranked_[p].first), coarse_,
+                qnorm_) <= topk_->worst())
+                return false;
+
+        if (!ip) {
+                stats::ScopedTimer timer(stats_, &SearchStats::lut_ns);
+                for (int d = 0; d < dim; d++)
+                        residual_[d] = q[d] - base[d];
+                table_ = index_->pq_->precompute_table(residual_.data());
+                if (stats_)
+                        stats_->lut_builds++;
+        }
+        if (stats_)
+                stats_->cells_probed++;
+        i0_ = 0;
+        open_ = true;
+        return true;
+}
 
+// Scans whole blocks of codes until `max_codes` worth of work has been done
+// in this step or the search is over. Each cell visit is charged
+// kCellVisitCost codes, whether or not the cell is scanned, so skipping
+// empty or bounded-out cells cannot run unbounded. Returns whether work
+// remains.
+bool IVFPQIndex::Search::step(long long max_codes) {
+        const int block = math::ProductQuantizer::kScanBlock;
+        long long spent = 0;
+        while (!done_ && spent < max_codes) {
+                if (!open_) {
+                        spent += kCellVisitCost;
+                        if (!open_cell())
+                                continue;
+                }
+                const Cell &cell = index_->cells_[cell_];
                 const int cell_size = (int)cell.ids.size();
-                for (int i = 0; i < cell_size; i++) {
-                        float approx = -pq_->approx_distance(
-                            table, cell.codes.data() + i * M);
-                        topk.push(cell.ids[i], approx);
+                const int nb = std::min(block, cell_size - i0_);
+                {
+                        stats::ScopedTimer timer(stats_, &SearchStats::scan_ns);
+                        index_->score_codes(cell, i0_, nb, table_, coarse_,
+                                           dists_.data());
+                }
+                const long long inserts = topk_->inserts();
+                {
+                        stats::ScopedTimer timer(stats_, &SearchStats::heap_ns);
+                        for (int j = 0; j < nb; j++)
+                                topk_->push(cell.ids[i0_ + j], dists_[j]);
+                }
+                if (stats_) {
+                        stats_->codes_scanned += nb;
+                        stats_->heap_pushes += topk_->inserts() - inserts;
+                }
+                i0_ += nb;
+                spent += nb;
+                scanned_ += nb;
+                if (i0_ >= cell_size)
+                        open_ = false;
+        }
+        return !done_;
+}
+
+std::vector<Hit> IVFPQIndex::Search::results() const {
+        math::TopK copy = *topk_;
+        return copy.take_sorted();
+}
+
+// Scores codes [i0, i0 + nb) of a cell for one query, given the table and
+// coarse term for that query and cell. Unit vectors under cosine are then
+// rescaled by their inverse reconstruction norm.
+void IVFPQIndex::score_codes(const Cell &cell, int i0, int nb,
+                             const std::vector<float> &table, float coarse,
+                             float *out) const {
+        const float sign = spec_.metric == Metric::Cosine ? 1.0f : -1.0f;
+        pq_->approx_distances(table, cell.codes.data() + i0 * pq_->M(), nb,
+                              out);
+        for (int j = 0; j < nb; j++)
+                out[j] = coarse + sign * out[j];
+        if (!corrects_norms())
+                return;
+        const float *levels = math::inv_norm_levels();
+        for (int j = 0; j < nb; j++)
+                out[j] *= levels[cell.inv_norms[i0 + j]];
+}
+
+std::vector<std::vector<Hit>>
+IVFPQIndex::search_batch(std::span<const float> queries, int k) const {
+        const int dim = spec_.dim;
+        const int nq = queries.size() / dim;
+        const int nprobe = std::min(spec_.nprobe, spec_.nlist);
+        const bool ip = spec_.metric == Metric::Cosine;
+
+        std::vector<float> qs(queries.begin(), queries.end());
+        if (should_normalize())
+                for (int i = 0; i < nq; i++)
+                        math::kernels::normalize(qs.data() + i * dim, dim);
+
+        // Group queries by the cells they probe, so that each inverted list
+        // is streamed once per batch and its codes stay in cache while every
+        // query in the group scores them. Only probed cells get a group, so
+        // a batch costs nothing for the cells it does not reach.
+        std::map<int, std::vector<int>> groups;
+        for (int i = 0; i < nq; i++) {
+                const auto ranked =
+                    rank_cells(qs.data() + i * dim, nprobe);
+                for (int p = 0; p < nprobe; p++)
+                        groups[ranked[p].second].push_back(i);
+        }
+
+        std::vector<std::vector<float>> ip_tables(ip ? nq : 0);
+        for (int i = 0; ip && i < nq; i++)
+                ip_tables[i] = pq_->precompute_ip_table(qs.data() + i * dim);
+
+        // With partitioned lists, one worker per node scans the lists placed
+        // on that node from the node's own CPUs, and the partial top-k
+        // results are merged afterwards.
+        const bool partitioned =
+            spec_.memory.numa == NumaPlacement::Partition &&
+            memory::online_nodes().size() > 1;
+        const std::vector<int> nodes =
+            partitioned ? memory::online_nodes() : std::vector<int>{-1};
+        std::vector<std::vector<math::TopK>> partial(
+            nodes.size(), std::vector<math::TopK>(nq, math::TopK(k)));
+        auto scan = [&](int w) {
+                for (const auto &[c, group] : groups) {
+                        if (nodes[w] >= 0 &&
+                            memory::list_node(spec_.memory, c) != nodes[w])
+                                continue;
+                        scan_group(c, group, qs.data(), ip_tables, partial[w]);
+                }
+        };
+        if (!partitioned) {
+                scan(0);
+        } else {
+                std::vector<std::thread> workers;
+                for (int w = 0; w < (int)nodes.size(); w++)
+                        workers.emplace_back([&, w] {
+                                memory::pin_to_node(nodes[w]);
+                                scan(w);
+                        });
+                for (auto &t : workers)
+                        t.join();
+        }
+
+        std::vector<std::vector<Hit>> results(nq);
+        for (int i = 0; i < nq; i++) {
+                if (nodes.size() == 1) {
+                        results[i] = partial[0][i].take_sorted();
+                        continue;
+                }
+                math::TopK merged(k);
+                for (auto &topks : partial)
+                        for (const Hit &h : topks[i].take_sorted())
+                                merged.push(h.id, h.score);
+                results[i] = merged.take_sorted();
+        }
+        return results;
+}
+
+// Scores every query of `group` against cell `c`, one block of codes at a
+// time so the block stays in cache across the group.
+void IVFPQIndex::scan_group(
+    int c, const std::vector<int> &group, const float *qs,
+    const std::vector<std::vector<float>> &ip_tables,
+    std::vector<math::TopK> &topks) const {
+        const Cell &cell = cells_[c];
+        if (group.empty() || cell.ids.empty())
+                return;
+
+        const int dim = spec_.dim;
+        const bool ip = spec_.metric == Metric::Cosine;
+        std::vector<float> centroid_buf(dim);
+        const float *base = cell_base(c, centroid_buf.data());
+        const int ng = (int)group.size();
+        std::vector<float> coarse(ng, 0.0f);
+        std::vector<std::vector<float>> tables(ng);
+        std::vector<float> residual(dim);
+        for (int g = 0; g < ng; g++) {
+                const float *q = qs + group[g] * dim;
+                if (ip) {
+                        coarse[g] = dot_(q, base, dim);
+                        continue;
+                }
+                for (int d = 0; d < dim; d++)
+                        residual[d] = q[d] - base[d];
+                tables[g] = pq_->precompute_table(residual.data());
+        }
+
+        const int block = math::ProductQuantizer::kScanBlock;
+        std::vector<float> dists(block);
+        const int cell_size = (int)cell.ids.size();
+        for (int i0 = 0; i0 < cell_size; i0 += block) {
+                const int nb = std::min(block, cell_size - i0);
+                for (int g = 0; g < ng; g++) {
+                        const int qi = group[g];
+                        score_codes(cell, i0, nb,
+                                    ip ? ip_tables[qi] : tables[g], coarse[g],
+                                    dists.data());
+                        for (int j = 0; j < nb; j++)
+                                topks[qi].push(cell.ids[i0 + j], dists[j]);
                 }
         }
-        return topk.take_sorted();
 }
 
 size_t IVFPQIndex::compressed_bytes() const {
         size_t total = 0;
         for (const auto &cell : cells_)
-                total += cell.codes.size();
+                total += cell.codes.size() + cell.inv_norms.size();
         return total;
 }
 
@@ -157,4 +805,80 @@ size_t IVFPQIndex::uncompressed_bytes() const {
         return (size_t)ntotal_ * spec_.dim * sizeof(float);
 }
 
-} // namespace spheni
\ No newline at end of file
+// Probes the same cells as search, skipping any whose bound falls short of
+// the radius, wherever it ranks.
+std::vector<Hit> IVFPQIndex::range_search(std::span<const float> query,
+                                          float radius) const {
+        const int dim = spec_.dim;
+        std::vector<float> q(query.begin(), query.end());
+        if (should_normalize())
+                math::kernels::normalize(q.data(), dim);
+
+        const int nprobe = std::min(spec_.nprobe, spec_.nlist);
+        const int max_probe =
+            spec_.adaptive_nprobe
+                ? math::probe_limit(nprobe, spec_.max_nprobe, spec_.nlist)
+                : nprobe;
+        std::unique_ptr<math::MultiSequence> sequence;
+        auto ranked = start_ranking(q.data(), max_probe, sequence);
+
+        const bool ip = spec_.metric == Metric::Cosine;
+        std::vector<float> table;
+        float qnorm = 0.0f;
+        if (ip) {
+                table = pq_->precompute_ip_table(q.data());
+                qnorm = std::sqrt(dot_(q.data(), q.data(), dim));
+        }
+        const float min_score = math::range_min_score(spec_.metric, radius);
+        const int block = math::ProductQuantizer::kScanBlock;
+        std::vector<float> residual(dim), centroid_buf(dim), dists(block);
+
+        std::vector<Hit> out;
+        for (int p = 0; p < max_probe; p++) {
+                if (!rank_through(p, ranked, sequence.get()) ||
+                    (p >= nprobe &&
+                     math::gap_exceeded(ranked, p, spec_.probe_gap_ratio)))
+                        break;
+                const int c = ranked[p].second;
+                const Cell &cell = cells_[c];
+                if (cell.ids.empty())
+                        continue;
+                const float *base = cell_base(c, centroid_buf.data());
+                const float coarse = ip ? dot_(q.data(), base, dim) : 0.0f;
+                if (cell_score_bound(c,
+                                     base_dist(q.data(), base, ranked[p].first),
+                                     coarse, qnorm) < min_score)
+                        continue;
+                if (!ip) {
+                        for (int d = 0; d < dim; d++)
+                                residual[d] = q[d] - base[d];
+                        table = pq_->precompute_table(residual.data());
+                }
+
+                const int n = (int)cell.ids.size();
+                for (int i0 = 0; i0 < n; i0 += block) {
+                        const int nb = std::min(block, n - i0);
+                        score_codes(cell, i0, nb, table, coarse, dists.data());
+                        for (int j = 0; j < nb; j++)
+                                if (dists[j] >= min_score)
+                                        out.push_back(
+                                            {cell.ids[i0 + j], dists[j]});
+                }
+        }
+        math::sort_hits(out);
+        return out;
+}
+
+std::vector<std::vector<Hit>>
+IVFPQIndex::range_search_batch(std::span<const float> queries,
+                               float radius) const {
+        const int dim = spec_.dim;
+        const int nq = queries.size() / dim;
+        std::vector<std::vector<Hit>> results(nq);
+        for (int i = 0; i < nq; i++)
+                results[i] =
+                    range_search(queries.subspan(i * dim, dim), radius);
+        return results;
+}
+
+} // namespace spheni
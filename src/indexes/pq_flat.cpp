@@ -2,15 +2,20 @@
 #include "math/pq.h"
 #include "math/topk.h"
 #include "spheni.h"
+#include "stats/timer.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <stdexcept>
 
 namespace spheni {
 
-PQFlatIndex::PQFlatIndex(const PQFlatSpec &spec) : spec_(spec) {
-        pq_ = std::make_unique<math::ProductQuantizer>(spec_.dim, spec_.M,
-                                                       spec_.ksub);
+PQFlatIndex::PQFlatIndex(const PQFlatSpec &spec)
+    : spec_(spec), codes_(StorageAllocator<uint8_t>(spec.memory)),
+      inv_norms_(StorageAllocator<uint8_t>(spec.memory)) {
+        pq_ = std::make_unique<math::ProductQuantizer>(
+            spec_.dim, spec_.M, spec_.ksub, spec_.memory);
 }
 
 PQFlatIndex::~PQFlatIndex() = default;
@@ -19,6 +24,12 @@ bool PQFlatIndex::should_normalize() const {
         return spec_.normalize; // && spec_.metric == Metric::Cosine;
 }
 
+// Cosine on unit vectors rescales each inner product by the inverse norm of
+// the reconstruction, which PQ does not keep at 1.
+bool PQFlatIndex::corrects_norms() const {
+        return spec_.metric == Metric::Cosine && should_normalize();
+}
+
 void PQFlatIndex::train(std::span<const float> vecs) {
         const int n = vecs.size() / spec_.dim;
         const bool norm = should_normalize();
@@ -56,12 +67,18 @@ void PQFlatIndex::add(std::span<const long long> ids,
                 math::kernels::normalize(tmp.data(), spec_.dim);
                 auto code = pq_->encode_one(tmp.data());
                 codes_.insert(codes_.end(), code.begin(), code.end());
+                if (corrects_norms())
+                        inv_norms_.push_back(math::quantize_inv_norm(
+                            1.0f / std::sqrt(pq_->code_norm_sq(code.data()))));
         }
         // printf(">> codes_.size() is %zu\n", codes_.size());
 }
 
-std::vector<Hit> PQFlatIndex::search(std::span<const float> query,
-                                     int k) const {
+// Scores every stored code against the query and hands each (position,
+// score) pair to `sink`.
+template <class Sink>
+void PQFlatIndex::scan(std::span<const float> query, SearchStats *stats,
+                       Sink &&sink) const {
         const bool norm = should_normalize();
         std::vector<float> tmp;
         const float *q = query.data();
@@ -71,17 +88,77 @@ std::vector<Hit> PQFlatIndex::search(std::span<const float> query,
                 q = tmp.data();
         }
 
-        auto table = pq_->precompute_table(q);
+        // Cosine scores the inner product with each reconstruction, rescaled
+        // by its inverse norm on unit vectors; L2 scores are negated ADC
+        // distances.
+        const bool ip = spec_.metric == Metric::Cosine;
+        std::vector<float> table;
+        {
+                stats::ScopedTimer timer(stats, &SearchStats::lut_ns);
+                table = ip ? pq_->precompute_ip_table(q)
+                           : pq_->precompute_table(q);
+        }
+        const float sign = ip ? 1.0f : -1.0f;
+        const bool rescale = corrects_norms();
+        const float *levels = math::inv_norm_levels();
         const int M = pq_->M();
-        math::TopK topk(k);
         // printf("ids_.size()=%zu codes_.size()=%zu M=%d expected_codes=%zu\n",
         // ids_.size(), codes_.size(), M, ids_.size() * M);
 
-        for (int i = 0; i < (int)(ids_.size()); i++) {
-                float approx =
-                    -pq_->approx_distance(table, codes_.data() + i * M);
-                topk.push(ids_[i], approx);
+        const int n = (int)ids_.size();
+        const int block = math::ProductQuantizer::kScanBlock;
+        std::vector<float> dists(block);
+        for (int i0 = 0; i0 < n; i0 += block) {
+                const int nb = std::min(block, n - i0);
+                {
+                        stats::ScopedTimer timer(stats, &SearchStats::scan_ns);
+                        pq_->approx_distances(table, codes_.data() + i0 * M,
+                                              nb, dists.data());
+                        if (rescale)
+                                for (int j = 0; j < nb; j++)
+                                        dists[j] *= levels[inv_norms_[i0 + j]];
+                }
+                stats::ScopedTimer timer(stats, &SearchStats::heap_ns);
+                for (int j = 0; j < nb; j++)
+                        sink(i0 + j, sign * dists[j]);
+        }
+        if (stats) {
+                stats->lut_builds++;
+                stats->codes_scanned += n;
         }
+}
+
+std::vector<Hit> PQFlatIndex::search(std::span<const float> query, int k,
+                                     SearchStats *stats) const {
+        math::TopK topk(k);
+        scan(query, stats,
+             [&](int i, float score) { topk.push(ids_[i], score); });
+        if (stats)
+                stats->heap_pushes += topk.inserts();
         return topk.take_sorted();
 }
+
+std::vector<Hit> PQFlatIndex::range_search(std::span<const float> query,
+                                           float radius) const {
+        const float min_score = math::range_min_score(spec_.metric, radius);
+        std::vector<Hit> out;
+        scan(query, nullptr, [&](int i, float score) {
+                if (score >= min_score)
+                        out.push_back({ids_[i], score});
+        });
+        math::sort_hits(out);
+        return out;
+}
+
+std::vector<std::vector<Hit>>
+PQFlatIndex::range_search_batch(std::span<const float> queries,
+                                float radius) const {
+        const int dim = spec_.dim;
+        const int nq = queries.size() / dim;
+        std::vector<std::vector<Hit>> results(nq);
+        for (int i = 0; i < nq; i++)
+                results[i] =
+                    range_search(queries.subspan(i * dim, dim), radius);
+        return results;
+}
 } // namespace spheni
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "math.h"
+#include <bit>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace spheni::math {
+
+namespace kernels {
+
+inline int hamming(const uint64_t *a, const uint64_t *b, int words) {
+        int sum = 0;
+        for (int i = 0; i < words; ++i) {
+                sum += std::popcount(a[i] ^ b[i]);
+        }
+        return sum;
+}
+
+template <int W>
+inline int hamming_fixed(const uint64_t *a, const uint64_t *b, int) {
+        int sum = 0;
+        for (int i = 0; i < W; ++i) {
+                sum += std::popcount(a[i] ^ b[i]);
+        }
+        return sum;
+}
+
+using HammingFn = int (*)(const uint64_t *, const uint64_t *, int);
+
+inline HammingFn select_hamming(int words) {
+        switch (words) {
+        case 2:
+                return hamming_fixed<2>;
+        case 4:
+                return hamming_fixed<4>;
+        case 6:
+                return hamming_fixed<6>;
+        case 8:
+                return hamming_fixed<8>;
+        case 12:
+                return hamming_fixed<12>;
+        case 16:
+                return hamming_fixed<16>;
+        }
+        return hamming;
+}
+
+} // namespace kernels
+
+inline int binary_words(int dim) { return (dim + 63) / 64; }
+
+// One bit per dimension, set when the component is positive.
+inline void pack_signs(const float *v, int dim, uint64_t *code) {
+        for (int w = 0; w < binary_words(dim); w++)
+                code[w] = 0;
+        for (int d = 0; d < dim; d++)
+                if (v[d] > 0.0f)
+                        code[d / 64] |= uint64_t{1} << (d % 64);
+}
+
+// Row-major random orthogonal matrix, from Gram-Schmidt on gaussian rows.
+inline std::vector<float> random_rotation(int dim) {
+        std::mt19937 rng(42);
+        std::normal_distribution<float> dist;
+        std::vector<float> r(dim * dim);
+        for (int i = 0; i < dim; i++) {
+                float *row = r.data() + i * dim;
+                for (int d = 0; d < dim; d++)
+                        row[d] = dist(rng);
+                for (int j = 0; j < i; j++) {
+                        const float *prev = r.data() + j * dim;
+                        const float p = kernels::dot(row, prev, dim);
+                        for (int d = 0; d < dim; d++)
+                                row[d] -= p * prev[d];
+                }
+                kernels::normalize(row, dim);
+        }
+        return r;
+}
+
+} // namespace spheni::math
@@ -8,7 +8,8 @@
 
 namespace spheni::math::clustering {
 KMeans::KMeans(int k, int dim, int max_iters)
-    : k_(k), dim_(dim), max_iters_(max_iters) {}
+    : k_(k), dim_(dim), max_iters_(max_iters),
+      l2_(math::kernels::select_l2(dim)) {}
 
 std::vector<float> KMeans::fit(std::span<const float> vectors) {
         const int n = vectors.size() / dim_;
@@ -34,8 +35,8 @@ std::vector<float> KMeans::fit(std::span<const float> vectors) {
 
                         const float *vec = vectors.data() + i * dim_;
                         for (int j = 0; j < c; ++j) {
-                                const float d = math::kernels::l2_squared(
-                                    vec, centroids.data() + j * dim_, dim_);
+                                const float d =
+                                    l2_(vec, centroids.data() + j * dim_, dim_);
                                 min_distances[i] =
                                     std::min(min_distances[i], d);
                         }
@@ -115,8 +116,7 @@ std::vector<int> KMeans::predict(std::span<const float> vectors,
 
                 for (int c = 0; c < k_; ++c) {
                         const float *centroid = centroids.data() + c * dim_;
-                        const float d =
-                            math::kernels::l2_squared(vec, centroid, dim_);
+                        const float d = l2_(vec, centroid, dim_);
                         if (d < min_dist) {
                                 min_dist = d;
                                 best_cluster = c;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "math.h"
 #include <span>
 #include <vector>
 
@@ -16,5 +17,6 @@ class KMeans {
         int k_;
         int dim_;
         int max_iters_;
+        kernels::DistFn l2_;
 };
 } // namespace spheni::math::clustering
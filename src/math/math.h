@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 
 namespace spheni::math {
 
@@ -34,5 +35,121 @@ inline void normalize(float *v, int d) {
         }
 }
 
+// Fixed-size variants for the dims and subspace widths used in practice. The
+// trailing int keeps the signature of the generic kernels so both can sit
+// behind the same function pointer.
+template <int D> inline float dot_fixed(const float *a, const float *b, int) {
+        float sum = 0.0f;
+        for (int i = 0; i < D; ++i) {
+                sum += a[i] * b[i];
+        }
+        return sum;
+}
+
+template <int D>
+inline float l2_squared_fixed(const float *a, const float *b, int) {
+        float sum = 0.0f;
+        for (int i = 0; i < D; ++i) {
+                const float diff = a[i] - b[i];
+                sum += diff * diff;
+        }
+        return sum;
+}
+
+using DistFn = float (*)(const float *, const float *, int);
+
+inline DistFn select_dot(int d) {
+        switch (d) {
+        case 2:
+                return dot_fixed<2>;
+        case 4:
+                return dot_fixed<4>;
+        case 8:
+                return dot_fixed<8>;
+        case 16:
+                return dot_fixed<16>;
+        case 24:
+                return dot_fixed<24>;
+        case 32:
+                return dot_fixed<32>;
+        case 128:
+                return dot_fixed<128>;
+        case 384:
+                return dot_fixed<384>;
+        case 768:
+                return dot_fixed<768>;
+        case 1024:
+                return dot_fixed<1024>;
+        }
+        return dot;
+}
+
+inline DistFn select_l2(int d) {
+        switch (d) {
+        case 2:
+                return l2_squared_fixed<2>;
+        case 4:
+                return l2_squared_fixed<4>;
+        case 8:
+                return l2_squared_fixed<8>;
+        case 16:
+                return l2_squared_fixed<16>;
+        case 24:
+                return l2_squared_fixed<24>;
+        case 32:
+                return l2_squared_fixed<32>;
+        case 128:
+                return l2_squared_fixed<128>;
+        case 384:
+                return l2_squared_fixed<384>;
+        case 768:
+                return l2_squared_fixed<768>;
+        case 1024:
+                return l2_squared_fixed<1024>;
+        }
+        return l2_squared;
+}
+
+// Asymmetric distances for `n` consecutive PQ codes of `M` bytes each, read
+// from a table of `M` rows with `ksub` entries.
+inline void adc_scan(const float *table, const uint8_t *codes, int n, int M,
+                     int ksub, float *out) {
+        for (int i = 0; i < n; ++i) {
+                const uint8_t *code = codes + i * M;
+                float d = 0.0f;
+                for (int m = 0; m < M; ++m)
+                        d += table[m * ksub + code[m]];
+                out[i] = d;
+        }
+}
+
+template <int M>
+inline void adc_scan_fixed(const float *table, const uint8_t *codes, int n,
+                           int, int ksub, float *out) {
+        for (int i = 0; i < n; ++i) {
+                const uint8_t *code = codes + i * M;
+                float d = 0.0f;
+                for (int m = 0; m < M; ++m)
+                        d += table[m * ksub + code[m]];
+                out[i] = d;
+        }
+}
+
+using AdcFn = void (*)(const float *, const uint8_t *, int, int, int, float *);
+
+inline AdcFn select_adc(int M) {
+        switch (M) {
+        case 8:
+                return adc_scan_fixed<8>;
+        case 16:
+                return adc_scan_fixed<16>;
+        case 32:
+                return adc_scan_fixed<32>;
+        case 64:
+                return adc_scan_fixed<64>;
+        }
+        return adc_scan;
+}
+
 } // namespace kernels
 } // namespace spheni::math
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "kmeans.h"
+#include "math.h"
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+#include <queue>
+#include <span>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace spheni::math {
+
+class MultiSequence;
+
+// Inverted multi-index coarse quantizer. Each half of a vector is quantized
+// with its own k-entry codebook, and cell i * k + j is the one whose
+// centroid is (first-half centroid i, second-half centroid j). This gives
+// k * k cells for the price of two k-entry scans.
+class MultiIndex {
+      public:
+        MultiIndex(int dim, int k)
+            : dim_(dim), k_(k), d1_(dim / 2), d2_(dim - dim / 2),
+              l2_1_(kernels::select_l2(d1_)), l2_2_(kernels::select_l2(d2_)) {}
+
+        int k() const { return k_; }
+        int nlist() const { return k_ * k_; }
+        // First-half codebook followed by the second-half codebook.
+        std::span<const float> codebooks() const { return codebooks_; }
+
+        void train(std::span<const float> vecs) {
+                const int n = vecs.size() / dim_;
+                std::vector<float> h1((size_t)n * d1_), h2((size_t)n * d2_);
+                for (int i = 0; i < n; i++) {
+                        const float *v = vecs.data() + (size_t)i * dim_;
+                        std::copy(v, v + d1_, h1.data() + (size_t)i * d1_);
+                        std::copy(v + d1_, v + dim_,
+                                  h2.data() + (size_t)i * d2_);
+                }
+                auto c1 = clustering::KMeans(k_, d1_).fit(h1);
+                auto c2 = clustering::KMeans(k_, d2_).fit(h2);
+                codebooks_ = std::move(c1);
+                codebooks_.insert(codebooks_.end(), c2.begin(), c2.end());
+        }
+
+        void set_codebooks(std::span<const float> codebooks) {
+                assert(codebooks.size() == (size_t)k_ * dim_);
+                codebooks_.assign(codebooks.begin(), codebooks.end());
+        }
+
+        // The halves are independent, so the nearest cell pairs the nearest
+        // centroid of each half.
+        int assign(const float *vec) const {
+                const auto d1 = half_distances(vec, 0);
+                const auto d2 = half_distances(vec, 1);
+                const int i = std::min_element(d1.begin(), d1.end()) -
+                              d1.begin();
+                const int j = std::min_element(d2.begin(), d2.end()) -
+                              d2.begin();
+                return i * k_ + j;
+        }
+
+        void centroid(int cell, float *out) const {
+                const float *c1 = first(cell / k_);
+                const float *c2 = second(cell % k_);
+                std::copy(c1, c1 + d1_, out);
+                std::copy(c2, c2 + d2_, out + d1_);
+        }
+
+        // The `n` nearest cells by squared L2 distance, in increasing order.
+        std::vector<std::pair<float, int>> rank(const float *query,
+                                                int n) const;
+
+      private:
+        friend class MultiSequence;
+        int dim_, k_, d1_, d2_;
+        kernels::DistFn l2_1_, l2_2_;
+        std::vector<float> codebooks_;
+
+        const float *first(int i) const {
+                return codebooks_.data() + (size_t)i * d1_;
+        }
+        const float *second(int j) const {
+                return codebooks_.data() + (size_t)k_ * d1_ + (size_t)j * d2_;
+        }
+
+        std::vector<float> half_distances(const float *vec, int half) const {
+                std::vector<float> d(k_);
+                for (int c = 0; c < k_; c++)
+                        d[c] = half == 0 ? l2_1_(vec, first(c), d1_)
+                                         : l2_2_(vec + d1_, second(c), d2_);
+                return d;
+        }
+};
+
+// Cells of a multi-index in increasing squared L2 distance to a query,
+// enumerated one at a time with the multi-sequence algorithm over the two
+// sorted lists of half distances. Only cells handed out, and their
+// neighbours on the frontier, are ever touched, so a search can stop early
+// without paying for all k * k cells.
+class MultiSequence {
+      public:
+        MultiSequence(const MultiIndex &index, const float *query)
+            : k_(index.k_), d1_(index.half_distances(query, 0)),
+              d2_(index.half_distances(query, 1)), o1_(k_), o2_(k_) {
+                std::iota(o1_.begin(), o1_.end(), 0);
+                std::iota(o2_.begin(), o2_.end(), 0);
+                std::sort(o1_.begin(), o1_.end(),
+                          [&](int a, int b) { return d1_[a] < d1_[b]; });
+                std::sort(o2_.begin(), o2_.end(),
+                          [&](int a, int b) { return d2_[a] < d2_[b]; });
+                push(0, 0);
+        }
+
+        // Next cell as (distance, cell), or false once every cell is out.
+        bool next(std::pair<float, int> &out) {
+                if (frontier_.empty())
+                        return false;
+                const auto [d, ab] = frontier_.top();
+                frontier_.pop();
+                const auto [a, b] = ab;
+                out = {d, o1_[a] * k_ + o2_[b]};
+                push(a + 1, b);
+                push(a, b + 1);
+                return true;
+        }
+
+      private:
+        using Entry = std::pair<float, std::pair<int, int>>;
+        int k_;
+        std::vector<float> d1_, d2_;
+        std::vector<int> o1_, o2_;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<>>
+            frontier_;
+        std::unordered_set<long long> seen_;
+
+        void push(int a, int b) {
+                if (a >= k_ || b >= k_ ||
+                    !seen_.insert((long long)a * k_ + b).second)
+                        return;
+                frontier_.push({d1_[o1_[a]] + d2_[o2_[b]], {a, b}});
+        }
+};
+
+inline std::vector<std::pair<float, int>>
+MultiIndex::rank(const float *query, int n) const {
+        MultiSequence sequence(*this, query);
+        n = std::min(n, nlist());
+        std::vector<std::pair<float, int>> out(n);
+        for (int i = 0; i < n; i++)
+                sequence.next(out[i]);
+        return out;
+}
+
+} // namespace spheni::math
@@ -2,6 +2,9 @@
 
 #include "kmeans.h"
 #include "math.h"
+#include "spheni.h"
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdint>
 #include <math.h>
@@ -9,18 +12,47 @@
 #include <vector>
 
 namespace spheni::math {
+
+// Cosine ADC on unit vectors divides by the norm of each reconstruction,
+// which lands close to 1. Its inverse is kept as one byte on a log2 scale
+// covering [1/2, 2].
+inline uint8_t quantize_inv_norm(float inv) {
+        const long q = std::lround((std::log2(inv) + 1.0f) * 127.5f);
+        return static_cast<uint8_t>(std::clamp(q, 0L, 255L));
+}
+
+inline const float *inv_norm_levels() {
+        static const std::array<float, 256> levels = [] {
+                std::array<float, 256> t;
+                for (int i = 0; i < 256; i++)
+                        t[i] = std::exp2(i / 127.5f - 1.0f);
+                return t;
+        }();
+        return levels.data();
+}
+
 class ProductQuantizer {
       public:
-        ProductQuantizer(int dim, int M, int ksub = 256)
-            : dim_(dim), M_(M), ksub_(ksub), dsub_(dim / M) {
+        ProductQuantizer(int dim, int M, int ksub = 256,
+                         const MemoryPolicy &memory = {})
+            : dim_(dim), M_(M), ksub_(ksub), dsub_(dim / M),
+              sub_l2_(kernels::select_l2(dsub_)),
+              sub_dot_(kernels::select_dot(dsub_)),
+              adc_(kernels::select_adc(M)),
+              codebooks_(StorageAllocator<float>(memory)) {
                 assert(dim % M == 0);
                 assert(ksub <= 256);
         }
+
+        // Codes scored per call to approx_distances by the index scans.
+        static constexpr int kScanBlock = 256;
+
         int M() const { return M_; }
         int ksub() const { return ksub_; }
         int dsub() const { return dsub_; }
         int dim() const { return dim_; }
         bool trained() const { return trained_; }
+        std::span<const float> codebooks() const { return codebooks_; }
 
         float approx_distance(const std::vector<float> &table,
                               const uint8_t *code) const {
@@ -29,6 +61,20 @@ class ProductQuantizer {
                         d += table[m * ksub_ + code[m]];
                 return d;
         }
+        void approx_distances(const std::vector<float> &table,
+                              const uint8_t *codes, int n, float *out) const {
+                adc_(table.data(), codes, n, M_, ksub_, out);
+        }
+        // Squared norm of the vector reconstructed from a code.
+        float code_norm_sq(const uint8_t *code) const {
+                float n = 0;
+                for (int m = 0; m < M_; m++) {
+                        const float *c =
+                            codebooks_.data() + (m * ksub_ + code[m]) * dsub_;
+                        n += sub_dot_(c, c, dsub_);
+                }
+                return n;
+        }
         void train(std::span<const float> vecs) {
                 const int n = vecs.size() / dim_;
                 codebooks_.resize(M_ * ksub_ * dsub_);
@@ -51,6 +97,15 @@ class ProductQuantizer {
                 trained_ = true;
         }
 
+        void decode_one(const uint8_t *code, float *vec) const {
+                assert(trained_);
+                for (int m = 0; m < M_; m++) {
+                        const float *c =
+                            codebooks_.data() + (m * ksub_ + code[m]) * dsub_;
+                        std::copy(c, c + dsub_, vec + m * dsub_);
+                }
+        }
+
         std::vector<uint8_t> encode_one(const float *vec) const {
                 assert(trained_);
                 std::vector<uint8_t> code(M_);
@@ -79,25 +134,40 @@ class ProductQuantizer {
                         const float *cb = codebooks_.data() + m * ksub_ * dsub_;
                         float *row = table.data() + m * ksub_;
                         for (int k = 0; k < ksub_; k++)
-                                // row[k] = kernels::dot(qsub, cb + k * dsub_,
-                                // dsub_);
-                                row[k] = kernels::l2_squared(
-                                    qsub, cb + k * dsub_, dsub_);
+                                row[k] = sub_l2_(qsub, cb + k * dsub_, dsub_);
+                }
+                return table;
+        }
+
+        // Same layout as precompute_table, but each entry is the inner
+        // product of the query subvector with the codeword, so summing a
+        // code's entries gives the inner product with its reconstruction.
+        std::vector<float> precompute_ip_table(const float *query) const {
+                assert(trained_);
+                std::vector<float> table(M_ * ksub_);
+                for (int m = 0; m < M_; m++) {
+                        const float *qsub = query + m * dsub_;
+                        const float *cb = codebooks_.data() + m * ksub_ * dsub_;
+                        float *row = table.data() + m * ksub_;
+                        for (int k = 0; k < ksub_; k++)
+                                row[k] = sub_dot_(qsub, cb + k * dsub_, dsub_);
                 }
                 return table;
         }
 
       private:
         int dim_, M_, ksub_, dsub_;
-        std::vector<float> codebooks_;
+        kernels::DistFn sub_l2_;
+        kernels::DistFn sub_dot_;
+        kernels::AdcFn adc_;
+        StorageVector<float> codebooks_;
         bool trained_ = false;
 
         uint8_t nearest_centroid(const float *sub, const float *cb) const {
                 float best = std::numeric_limits<float>::max();
                 uint8_t index = 0;
                 for (int k = 0; k < ksub_; k++) {
-                        float d =
-                            kernels::l2_squared(sub, cb + k * dsub_, dsub_);
+                        float d = sub_l2_(sub, cb + k * dsub_, dsub_);
                         if (d < best) {
                                 best = d;
                                 // https://en.cppreference.com/w/cpp/language/static_cast.html
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "math.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace spheni::math {
+
+// Coarse cells ordered by squared L2 distance between query and centroid.
+// Only the first `n` entries are sorted.
+inline std::vector<std::pair<float, int>>
+rank_cells(kernels::DistFn l2, const float *query, const float *centroids,
+           int nlist, int dim, int n) {
+        std::vector<std::pair<float, int>> dists(nlist);
+        for (int c = 0; c < nlist; c++)
+                dists[c] = {l2(query, centroids + c * dim, dim), c};
+        n = std::min(n, nlist);
+        std::partial_sort(dists.begin(), dists.begin() + n, dists.end());
+        return dists;
+}
+
+// Upper bound on the number of cells visited by adaptive probing. A
+// `max_nprobe` of zero lets the search run over every cell.
+inline int probe_limit(int nprobe, int max_nprobe, int nlist) {
+        if (max_nprobe <= 0)
+                return nlist;
+        return std::min(std::max(max_nprobe, nprobe), nlist);
+}
+
+// Lower bound on the squared L2 distance from the query to any vector of a
+// cell, given the squared query-centroid distance and the cell radius.
+inline float cell_lower_bound(float centroid_dist_sq, float radius) {
+        const float d = std::sqrt(centroid_dist_sq) - radius;
+        return d > 0.0f ? d * d : 0.0f;
+}
+
+// Whether cell `p` of the ranking is far enough behind the nearest cell that
+// adaptive probing should stop before visiting it.
+inline bool gap_exceeded(const std::vector<std::pair<float, int>> &ranked,
+                         int p, float gap_ratio) {
+        if (gap_ratio <= 0.0f)
+                return false;
+        return ranked[p].first > gap_ratio * ranked[0].first;
+}
+
+} // namespace spheni::math
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "kmeans.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace spheni::math {
+
+// Vectors waiting to be placed in inverted list `cell`.
+struct CellGroup {
+        int cell;
+        std::vector<long long> ids;
+        std::vector<float> vecs;
+};
+
+// Splits groups with local 2-means until each holds fewer than `split_at`
+// vectors. A split keeps one half in the group's cell, moving its centroid,
+// and appends a cell for the other half. Groups that 2-means cannot separate
+// are left whole. Returns the number of splits.
+inline int split_groups(std::vector<CellGroup> &groups,
+                        std::vector<float> &centroids, int dim,
+                        long long split_at) {
+        int splits = 0;
+        std::vector<CellGroup> done;
+        while (!groups.empty()) {
+                CellGroup g = std::move(groups.back());
+                groups.pop_back();
+                const long long n = g.ids.size();
+                if (n < split_at || n < 2) {
+                        done.push_back(std::move(g));
+                        continue;
+                }
+
+                clustering::KMeans km(2, dim);
+                const auto two = km.fit(g.vecs);
+                const auto assign = km.predict(g.vecs, two);
+                CellGroup halves[2];
+                for (long long i = 0; i < n; i++) {
+                        CellGroup &h = halves[assign[i]];
+                        h.ids.push_back(g.ids[i]);
+                        h.vecs.insert(h.vecs.end(), g.vecs.begin() + i * dim,
+                                      g.vecs.begin() + (i + 1) * dim);
+                }
+                if (halves[0].ids.empty() || halves[1].ids.empty()) {
+                        done.push_back(std::move(g));
+                        continue;
+                }
+
+                halves[0].cell = g.cell;
+                halves[1].cell = centroids.size() / dim;
+                std::copy(two.begin(), two.begin() + dim,
+                          centroids.begin() + g.cell * dim);
+                centroids.insert(centroids.end(), two.begin() + dim,
+                                 two.end());
+                splits++;
+                groups.push_back(std::move(halves[0]));
+                groups.push_back(std::move(halves[1]));
+        }
+        groups = std::move(done);
+        return splits;
+}
+
+} // namespace spheni::math
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "spheni.h"
+#include <algorithm>
 #include <queue>
 #include <vector>
 
@@ -13,12 +14,20 @@ class TopK {
         void push(long long id, float score) {
                 if (heap_.size() < static_cast<std::size_t>(k_)) {
                         heap_.emplace(id, score);
+                        ++inserts_;
                 } else if (score > heap_.top().score) {
                         heap_.pop();
                         heap_.emplace(id, score);
+                        ++inserts_;
                 }
         }
 
+        bool full() const {
+                return heap_.size() >= static_cast<std::size_t>(k_);
+        }
+        float worst() const { return heap_.top().score; }
+        long long inserts() const { return inserts_; }
+
         std::vector<Hit> take_sorted() {
                 std::vector<Hit> results(heap_.size());
                 for (auto it = results.rbegin(); it != results.rend(); ++it) {
@@ -30,6 +39,7 @@ class TopK {
 
       private:
         int k_;
+        long long inserts_ = 0;
         struct WorseScore {
                 bool operator()(const Hit &a, const Hit &b) const {
                         return a.score > b.score;
@@ -38,4 +48,16 @@ class TopK {
         std::priority_queue<Hit, std::vector<Hit>, WorseScore> heap_;
 };
 
+// Lowest score a range search keeps. `radius` bounds the squared L2 distance
+// under L2, and the cosine distance 1 - score under cosine.
+inline float range_min_score(Metric metric, float radius) {
+        return metric == Metric::L2 ? -radius : 1.0f - radius;
+}
+
+inline void sort_hits(std::vector<Hit> &hits) {
+        std::sort(hits.begin(), hits.end(), [](const Hit &a, const Hit &b) {
+                return a.score > b.score;
+        });
+}
+
 } // namespace spheni::math
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "spheni.h"
+#include <vector>
+
+namespace spheni::memory {
+
+// Online NUMA nodes, read from sysfs. A machine without NUMA reports node 0.
+const std::vector<int> &online_nodes();
+
+// Policy for inverted list `list`: with NumaPlacement::Partition each list is
+// bound to one node, round-robin over the online nodes. A single-node host
+// gets the default placement.
+MemoryPolicy list_policy(const MemoryPolicy &policy, int list);
+
+// Node a list was placed on by list_policy, or -1 when lists are not
+// partitioned or the host has a single node.
+int list_node(const MemoryPolicy &policy, int list);
+
+// Restricts the calling thread to the CPUs of `node`. Returns false when the
+// node's CPU list cannot be read or applied.
+bool pin_to_node(int node);
+
+} // namespace spheni::memory
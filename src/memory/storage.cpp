@@ -0,0 +1,328 @@
+#include "memory/numa.h"
+#include "spheni.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <new>
+
+// Page placement and CPU pinning use Linux interfaces. Elsewhere every
+// allocation comes from the aligned heap and pinning reports failure.
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <linux/mman.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace spheni {
+
+namespace {
+
+// Allocations below this size stay on the regular heap: mapping them would
+// cost a syscall per vector growth step for little placement benefit. Bound
+// allocations are the exception, since a partitioned inverted list is
+// usually smaller than this and must still live on its node; they come from
+// per-node slabs instead.
+constexpr std::size_t kMapThreshold = 64 << 10;
+constexpr std::size_t kSlabBytes = 1 << 20;
+constexpr int kMinClassShift = 6;
+constexpr int kClasses = 11;
+constexpr int kMaxNodes = 64;
+constexpr std::size_t kSmallPage = 4 << 10;
+constexpr std::size_t kHuge2M = 2 << 20;
+constexpr std::size_t kHuge1G = 1 << 30;
+
+// Parses sysfs lists such as "0-3,8,10-11".
+std::vector<int> parse_list(const char *path) {
+        std::vector<int> out;
+        FILE *f = std::fopen(path, "r");
+        if (!f)
+                return out;
+        int lo, hi;
+        while (std::fscanf(f, "%d", &lo) == 1) {
+                hi = lo;
+                int c = std::fgetc(f);
+                if (c == '-') {
+                        if (std::fscanf(f, "%d", &hi) != 1)
+                                break;
+                        c = std::fgetc(f);
+                }
+                for (int i = lo; i <= hi; i++)
+                        out.push_back(i);
+                if (c != ',')
+                        break;
+        }
+        std::fclose(f);
+        return out;
+}
+
+// NUMA placement means nothing on a single node, where such policies behave
+// as the default.
+NumaPlacement placement(const MemoryPolicy &policy) {
+        return memory::online_nodes().size() > 1 ? policy.numa
+                                                 : NumaPlacement::Default;
+}
+
+std::size_t alignment(const MemoryPolicy &policy) {
+        return std::max(policy.alignment, sizeof(void *));
+}
+
+bool uses_pool(std::size_t bytes, const MemoryPolicy &policy) {
+#if defined(__linux__)
+        return placement(policy) == NumaPlacement::Bind &&
+               bytes < kMapThreshold && alignment(policy) <= kSmallPage &&
+               policy.node >= 0 && policy.node < kMaxNodes;
+#else
+        (void)bytes;
+        (void)policy;
+        return false;
+#endif
+}
+
+bool uses_mapping(std::size_t bytes, const MemoryPolicy &policy) {
+#if defined(__linux__)
+        return bytes >= kMapThreshold &&
+               (policy.pages != PageSize::Default ||
+                placement(policy) != NumaPlacement::Default);
+#else
+        (void)bytes;
+        (void)policy;
+        return false;
+#endif
+}
+
+// Huge pages only back allocations that fill at least one of them.
+std::size_t page_size(std::size_t bytes, const MemoryPolicy &policy) {
+        if (policy.pages == PageSize::Huge1G && bytes >= kHuge1G)
+                return kHuge1G;
+        if (policy.pages != PageSize::Default && bytes >= kHuge2M)
+                return kHuge2M;
+        return kSmallPage;
+}
+
+std::size_t round_up(std::size_t bytes, std::size_t page) {
+        return (bytes + page - 1) / page * page;
+}
+
+#if defined(__linux__)
+void apply_numa(void *p, std::size_t len, const MemoryPolicy &policy) {
+        unsigned long mask = 0;
+        int mode = MPOL_DEFAULT;
+        switch (placement(policy)) {
+        case NumaPlacement::Default:
+                return;
+        case NumaPlacement::Interleave:
+        case NumaPlacement::Partition:
+                for (int n : memory::online_nodes())
+                        if (n < 64)
+                                mask |= 1UL << n;
+                mode = MPOL_INTERLEAVE;
+                break;
+        case NumaPlacement::Bind:
+                if (policy.node < 0 || policy.node >= 64)
+                        return;
+                mask = 1UL << policy.node;
+                mode = MPOL_BIND;
+                break;
+        }
+        // Placement is best effort: without NUMA support the kernel rejects
+        // the call and the mapping keeps the default policy.
+        syscall(SYS_mbind, p, len, mode, &mask, 64, 0);
+}
+
+void *map_storage(std::size_t bytes, const MemoryPolicy &policy) {
+        const std::size_t page = page_size(bytes, policy);
+        const std::size_t len = round_up(bytes, page);
+        const int base = MAP_PRIVATE | MAP_ANONYMOUS;
+        void *p = MAP_FAILED;
+        if (page != kSmallPage) {
+                const int huge =
+                    page == kHuge1G ? MAP_HUGE_1GB : MAP_HUGE_2MB;
+                p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                         base | MAP_HUGETLB | huge, -1, 0);
+        }
+        if (p == MAP_FAILED) {
+                // No reserved huge pages: fall back to transparent ones.
+                p = mmap(nullptr, len, PROT_READ | PROT_WRITE, base, -1, 0);
+                if (p == MAP_FAILED)
+                        return nullptr;
+                if (page != kSmallPage)
+                        madvise(p, len, MADV_HUGEPAGE);
+        }
+        apply_numa(p, len, policy);
+        return p;
+}
+
+// Power-of-two size classes from 64 B up to kMapThreshold, each with a free
+// list per node. Blocks are aligned to their class size, capped at a page,
+// and a class is never smaller than the alignment asked for, so a freed
+// block suits any later policy that maps to its class. Slabs are never
+// returned to the kernel.
+struct NodePool {
+        std::mutex mu;
+        std::array<std::vector<void *>, kClasses> free;
+        char *slab = nullptr;
+        std::size_t left = 0;
+};
+
+NodePool &node_pool(int node) {
+        // Leaked so that storage freed during static destruction still finds
+        // its pool.
+        static auto *pools = new std::array<NodePool, kMaxNodes>;
+        return (*pools)[node];
+}
+
+int size_class(std::size_t bytes, const MemoryPolicy &policy) {
+        const std::size_t size = std::max(bytes, alignment(policy));
+        return std::max(0, (int)std::bit_width(size - 1) - kMinClassShift);
+}
+
+void *pool_allocate(std::size_t bytes, const MemoryPolicy &policy) {
+        const int cls = size_class(bytes, policy);
+        const std::size_t size = std::size_t(1) << (cls + kMinClassShift);
+        const std::size_t align = std::min(size, kSmallPage);
+        NodePool &pool = node_pool(policy.node);
+        std::lock_guard<std::mutex> lock(pool.mu);
+        if (!pool.free[cls].empty()) {
+                void *p = pool.free[cls].back();
+                pool.free[cls].pop_back();
+                return p;
+        }
+        const std::size_t pad =
+            (align - (std::size_t)pool.slab % align) % align;
+        if (!pool.slab || pool.left < pad + size) {
+                pool.slab = static_cast<char *>(map_storage(kSlabBytes, policy));
+                if (!pool.slab) {
+                        pool.left = 0;
+                        return nullptr;
+                }
+                pool.left = kSlabBytes;
+        } else {
+                pool.slab += pad;
+                pool.left -= pad;
+        }
+        void *p = pool.slab;
+        pool.slab += size;
+        pool.left -= size;
+        return p;
+}
+
+void pool_free(void *p, std::size_t bytes, const MemoryPolicy &policy) {
+        NodePool &pool = node_pool(policy.node);
+        std::lock_guard<std::mutex> lock(pool.mu);
+        pool.free[size_class(bytes, policy)].push_back(p);
+}
+#endif
+
+} // namespace
+
+namespace memory {
+
+const std::vector<int> &online_nodes() {
+        static const std::vector<int> nodes = [] {
+                auto n = parse_list("/sys/devices/system/node/online");
+                if (n.empty())
+                        n.push_back(0);
+                return n;
+        }();
+        return nodes;
+}
+
+MemoryPolicy list_policy(const MemoryPolicy &policy, int list) {
+        if (policy.numa != NumaPlacement::Partition)
+                return policy;
+        MemoryPolicy p = policy;
+        if (online_nodes().size() <= 1) {
+                p.numa = NumaPlacement::Default;
+                return p;
+        }
+        p.numa = NumaPlacement::Bind;
+        p.node = list_node(policy, list);
+        return p;
+}
+
+int list_node(const MemoryPolicy &policy, int list) {
+        const auto &nodes = online_nodes();
+        if (policy.numa != NumaPlacement::Partition || nodes.size() <= 1)
+                return -1;
+        return nodes[list % nodes.size()];
+}
+
+bool pin_to_node(int node) {
+#if defined(__linux__)
+        char path[64];
+        std::snprintf(path, sizeof(path),
+                      "/sys/devices/system/node/node%d/cpulist", node);
+        const auto cpus = parse_list(path);
+        if (cpus.empty())
+                return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : cpus)
+                CPU_SET(c, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+        (void)node;
+        return false;
+#endif
+}
+
+} // namespace memory
+
+void *allocate_storage(std::size_t bytes, const MemoryPolicy &policy) {
+        const bool pooled = uses_pool(bytes, policy);
+        if (!pooled && !uses_mapping(bytes, policy))
+                return ::operator new(bytes,
+                                      std::align_val_t(alignment(policy)));
+#if defined(__linux__)
+        if (void *p = pooled ? pool_allocate(bytes, policy)
+                             : map_storage(bytes, policy))
+                return p;
+#endif
+        // The library is built without exceptions, and the containers this
+        // backs cannot take a null pointer.
+        std::fprintf(stderr, "spheni: cannot map %zu bytes of storage\n",
+                     bytes);
+        std::abort();
+}
+
+void free_storage(void *p, std::size_t bytes, const MemoryPolicy &policy) {
+        if (!p)
+                return;
+#if defined(__linux__)
+        if (uses_pool(bytes, policy)) {
+                pool_free(p, bytes, policy);
+                return;
+        }
+        if (uses_mapping(bytes, policy)) {
+                munmap(p, round_up(bytes, page_size(bytes, policy)));
+                return;
+        }
+#endif
+        ::operator delete(p, std::align_val_t(alignment(policy)));
+}
+
+const MemoryPolicy *storage_policy(const MemoryPolicy &policy) {
+        if (policy == kDefaultMemoryPolicy)
+                return &kDefaultMemoryPolicy;
+        // A deque keeps earlier entries in place as it grows. Leaked for the
+        // same reason as the node pools.
+        static std::mutex mu;
+        static auto *interned = new std::deque<MemoryPolicy>;
+        std::lock_guard<std::mutex> lock(mu);
+        for (const MemoryPolicy &p : *interned)
+                if (p == policy)
+                        return &p;
+        return &interned->emplace_back(policy);
+}
+
+int numa_node_count() { return memory::online_nodes().size(); }
+
+} // namespace spheni
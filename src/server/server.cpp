@@ -0,0 +1,285 @@
+#include "spheni.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace spheni {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// A client hanging up must not raise SIGPIPE in the host. Where send() has
+// no MSG_NOSIGNAL, as on macOS, each connection sets SO_NOSIGPIPE instead.
+#if defined(MSG_NOSIGNAL)
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+bool read_full(int fd, void *buf, size_t len) {
+        char *p = static_cast<char *>(buf);
+        while (len > 0) {
+                const ssize_t r = recv(fd, p, len, 0);
+                if (r <= 0)
+                        return false;
+                p += r;
+                len -= r;
+        }
+        return true;
+}
+
+bool write_full(int fd, const void *buf, size_t len) {
+        const char *p = static_cast<const char *>(buf);
+        while (len > 0) {
+                const ssize_t w = send(fd, p, len, kSendFlags);
+                if (w <= 0)
+                        return false;
+                p += w;
+                len -= w;
+        }
+        return true;
+}
+
+} // namespace
+
+struct SearchServer::Impl {
+        struct Pending {
+                std::vector<float> query;
+                int k;
+                Clock::time_point arrived;
+                std::vector<Hit> hits;
+                long long latency_ns = 0;
+                bool done = false;
+        };
+
+        const IVFPQIndex &index;
+        ServerOptions options;
+        int listen_fd = -1;
+        std::atomic<bool> accepting{false};
+        std::thread accept_thread;
+        std::thread batch_thread;
+
+        std::mutex conn_mu;
+        std::condition_variable conn_cv;
+        std::vector<int> conn_fds;
+
+        std::mutex queue_mu;
+        std::condition_variable queue_cv;
+        std::condition_variable done_cv;
+        std::vector<Pending *> queue;
+        bool batching = false;
+
+        Impl(const IVFPQIndex &index, const ServerOptions &options)
+            : index(index), options(options) {}
+
+        void accept_loop();
+        void serve_connection(int fd);
+        void batch_loop();
+        void run_batch(std::vector<Pending *> &batch);
+};
+
+void SearchServer::Impl::accept_loop() {
+        while (accepting) {
+                const int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                        if (!accepting)
+                                break;
+                        continue;
+                }
+#if defined(SO_NOSIGPIPE)
+                const int one = 1;
+                setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+                {
+                        std::lock_guard<std::mutex> lock(conn_mu);
+                        conn_fds.push_back(fd);
+                }
+                std::thread([this, fd] { serve_connection(fd); }).detach();
+        }
+}
+
+// Request:  int32 k, int32 dim, float[dim]
+// Response: int32 n, int64 latency_ns, n x (int64 id, float32 score)
+// k is clamped to options.max_k. A request with k <= 0 or a dim that does
+// not match the index gets n = -1 and closes the connection, so it never
+// reaches a batch.
+void SearchServer::Impl::serve_connection(int fd) {
+        const int dim = index.dim();
+        for (;;) {
+                int32_t header[2];
+                if (!read_full(fd, header, sizeof(header)))
+                        break;
+                const int k = std::min(header[0], options.max_k);
+                if (header[1] != dim || k <= 0) {
+                        const int32_t n = -1;
+                        const int64_t latency = 0;
+                        write_full(fd, &n, sizeof(n));
+                        write_full(fd, &latency, sizeof(latency));
+                        break;
+                }
+
+                Pending req;
+                req.k = k;
+                req.query.resize(dim);
+                if (!read_full(fd, req.query.data(), dim * sizeof(float)))
+                        break;
+                req.arrived = Clock::now();
+
+                {
+                        std::unique_lock<std::mutex> lock(queue_mu);
+                        queue.push_back(&req);
+                        queue_cv.notify_one();
+                        done_cv.wait(lock, [&] { return req.done; });
+                }
+
+                const int32_t n = req.hits.size();
+                const int64_t latency = req.latency_ns;
+                bool ok = write_full(fd, &n, sizeof(n)) &&
+                          write_full(fd, &latency, sizeof(latency));
+                for (const Hit &h : req.hits) {
+                        const int64_t id = h.id;
+                        ok = ok && write_full(fd, &id, sizeof(id)) &&
+                             write_full(fd, &h.score, sizeof(h.score));
+                }
+                if (!ok)
+                        break;
+        }
+
+        std::lock_guard<std::mutex> lock(conn_mu);
+        close(fd);
+        conn_fds.erase(std::find(conn_fds.begin(), conn_fds.end(), fd));
+        conn_cv.notify_all();
+}
+
+// Waits for a first query, then keeps collecting until the batch is full or
+// the window opened by that query has elapsed.
+void SearchServer::Impl::batch_loop() {
+        std::unique_lock<std::mutex> lock(queue_mu);
+        for (;;) {
+                queue_cv.wait(lock,
+                              [&] { return !queue.empty() || !batching; });
+                if (queue.empty())
+                        break;
+
+                const auto deadline =
+                    queue.front()->arrived +
+                    std::chrono::microseconds(options.window_us);
+                queue_cv.wait_until(lock, deadline, [&] {
+                        return (int)queue.size() >= options.max_batch ||
+                               !batching;
+                });
+
+                const int take =
+                    std::min<int>(queue.size(), std::max(options.max_batch, 1));
+                std::vector<Pending *> batch(queue.begin(),
+                                             queue.begin() + take);
+                queue.erase(queue.begin(), queue.begin() + take);
+
+                lock.unlock();
+                run_batch(batch);
+                lock.lock();
+
+                for (Pending *p : batch)
+                        p->done = true;
+                done_cv.notify_all();
+        }
+}
+
+// Queries are grouped by k, so one client asking for many hits does not
+// widen the search of every other query in the batch.
+void SearchServer::Impl::run_batch(std::vector<Pending *> &batch) {
+        const int dim = index.dim();
+        std::map<int, std::vector<Pending *>> by_k;
+        for (Pending *p : batch)
+                by_k[p->k].push_back(p);
+
+        for (auto &[k, group] : by_k) {
+                std::vector<float> queries(group.size() * dim);
+                for (size_t i = 0; i < group.size(); i++)
+                        std::copy(group[i]->query.begin(),
+                                  group[i]->query.end(),
+                                  queries.begin() + i * dim);
+
+                auto results = index.search_batch(queries, k);
+                const auto finished = Clock::now();
+                for (size_t i = 0; i < group.size(); i++) {
+                        Pending *p = group[i];
+                        p->hits = std::move(results[i]);
+                        p->latency_ns = std::chrono::duration_cast<
+                                            std::chrono::nanoseconds>(
+                                            finished - p->arrived)
+                                            .count();
+                }
+        }
+}
+
+SearchServer::SearchServer(const IVFPQIndex &index,
+                           const ServerOptions &options)
+    : impl_(std::make_unique<Impl>(index, options)) {}
+
+SearchServer::~SearchServer() { stop(); }
+
+bool SearchServer::start() {
+        if (impl_->options.max_k <= 0)
+                return false;
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        const std::string &path = impl_->options.socket_path;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path))
+                return false;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+                return false;
+        unlink(path.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+            listen(fd, SOMAXCONN) < 0) {
+                close(fd);
+                return false;
+        }
+
+        impl_->listen_fd = fd;
+        impl_->batching = true;
+        impl_->accepting = true;
+        impl_->batch_thread = std::thread([this] { impl_->batch_loop(); });
+        impl_->accept_thread = std::thread([this] { impl_->accept_loop(); });
+        return true;
+}
+
+// Stops accepting, lets open connections finish their current request, then
+// drains the batch queue.
+void SearchServer::stop() {
+        if (!impl_->accepting.exchange(false))
+                return;
+        shutdown(impl_->listen_fd, SHUT_RDWR);
+        impl_->accept_thread.join();
+        close(impl_->listen_fd);
+        unlink(impl_->options.socket_path.c_str());
+
+        {
+                std::unique_lock<std::mutex> lock(impl_->conn_mu);
+                for (int fd : impl_->conn_fds)
+                        shutdown(fd, SHUT_RD);
+                impl_->conn_cv.wait(lock,
+                                    [&] { return impl_->conn_fds.empty(); });
+        }
+
+        {
+                std::lock_guard<std::mutex> lock(impl_->queue_mu);
+                impl_->batching = false;
+                impl_->queue_cv.notify_all();
+        }
+        impl_->batch_thread.join();
+}
+
+} // namespace spheni
@@ -0,0 +1,53 @@
+#include "spheni.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace spheni {
+
+void Histogram::add(long long value) {
+        const int b =
+            value <= 0 ? 0 : std::bit_width(static_cast<uint64_t>(value));
+        ++counts[std::min(b, kBuckets - 1)];
+        ++total;
+        sum += value;
+        max = std::max(max, value);
+}
+
+long long Histogram::quantile(double p) const {
+        const long long rank = static_cast<long long>(p * total);
+        long long seen = 0;
+        for (int b = 0; b < kBuckets; b++) {
+                seen += counts[b];
+                if (seen > rank || seen == total)
+                        return b == 0 ? 0
+                                      : std::min<long long>(
+                                            max, (uint64_t{1} << b) - 1);
+        }
+        return max;
+}
+
+void StatsAggregator::record(const SearchStats &stats) {
+        std::lock_guard<std::mutex> lock(mu_);
+        ++data_.queries;
+        data_.cells_probed.add(stats.cells_probed);
+        data_.codes_scanned.add(stats.codes_scanned);
+        data_.heap_pushes.add(stats.heap_pushes);
+        data_.lut_builds.add(stats.lut_builds);
+        data_.coarse_ns.add(stats.coarse_ns);
+        data_.lut_ns.add(stats.lut_ns);
+        data_.scan_ns.add(stats.scan_ns);
+        data_.heap_ns.add(stats.heap_ns);
+}
+
+StatsAggregator::Snapshot StatsAggregator::snapshot() const {
+        std::lock_guard<std::mutex> lock(mu_);
+        return data_;
+}
+
+void StatsAggregator::reset() {
+        std::lock_guard<std::mutex> lock(mu_);
+        data_ = Snapshot{};
+}
+
+} // namespace spheni
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "spheni.h"
+#include <chrono>
+
+namespace spheni::stats {
+
+// Adds the time spent in its scope to one phase of a SearchStats. Compiles to
+// nothing unless the library is built with SPHENI_TIMERS, and does nothing
+// when no stats were requested.
+class ScopedTimer {
+      public:
+#ifdef SPHENI_TIMERS
+        ScopedTimer(SearchStats *stats, long long SearchStats::*phase)
+            : sink_(stats ? &(stats->*phase) : nullptr) {
+                if (sink_)
+                        start_ = std::chrono::steady_clock::now();
+        }
+        ~ScopedTimer() {
+                if (sink_)
+                        *sink_ += std::chrono::duration_cast<
+                                      std::chrono::nanoseconds>(
+                                      std::chrono::steady_clock::now() - start_)
+                                      .count();
+        }
+
+      private:
+        long long *sink_;
+        std::chrono::steady_clock::time_point start_;
+#else
+        ScopedTimer(SearchStats *, long long SearchStats::*) {}
+#endif
+};
+
+} // namespace spheni::stats
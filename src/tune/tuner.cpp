@@ -0,0 +1,265 @@
+#include "math/kmeans.h"
+#include "math/math.h"
+#include "math/multi_index.h"
+#include "spheni.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <unordered_set>
+
+namespace spheni {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+bool is_square(int nlist) {
+        const int k = (int)std::lround(std::sqrt((double)nlist));
+        return k * k == nlist;
+}
+
+// Around sqrt(n) lists. A multi-index needs k * k cells, so its candidates
+// are rounded to the nearest square.
+std::vector<int> default_nlists(int n, CoarseQuantizer coarse) {
+        const int s = (int)std::lround(std::sqrt((double)n));
+        std::vector<int> out;
+        for (int nlist : {s / 2, s, 2 * s}) {
+                if (coarse == CoarseQuantizer::MultiIndex) {
+                        const int k = (int)std::lround(std::sqrt((double)nlist));
+                        nlist = k * k;
+                }
+                if (nlist >= 1 && nlist <= n)
+                        out.push_back(nlist);
+        }
+        return out;
+}
+
+std::vector<int> default_Ms(int dim) {
+        std::vector<int> out;
+        for (int M : {8, 16, 32, 64})
+                if (M <= dim && dim % M == 0)
+                        out.push_back(M);
+        if (out.empty())
+                out.push_back(dim);
+        return out;
+}
+
+std::vector<int> default_nprobes(int nlist) {
+        std::vector<int> out;
+        for (int p = 1; p < nlist; p *= 2)
+                out.push_back(p);
+        out.push_back(nlist);
+        return out;
+}
+
+std::vector<int> sorted_unique(std::vector<int> v) {
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+        return v;
+}
+
+float recall_at_k(const std::vector<Hit> &hits, const std::vector<Hit> &truth) {
+        if (truth.empty())
+                return 1.0f;
+        std::unordered_set<long long> want;
+        for (const Hit &h : truth)
+                want.insert(h.id);
+        int found = 0;
+        for (const Hit &h : hits)
+                found += want.count(h.id);
+        return (float)found / truth.size();
+}
+
+// A multi-index stores two half codebooks rather than nlist centroids, so
+// the coarse size comes from the index itself.
+size_t index_bytes(const IVFPQIndex &index, const IVFPQSpec &spec) {
+        return index.compressed_bytes() +
+               (size_t)index.size() * sizeof(long long) +
+               index.centroids().size() * sizeof(float) +
+               (size_t)spec.ksub * spec.dim * sizeof(float);
+}
+
+// Coarse centroids alone, or for a multi-index its two half codebooks.
+// `vecs` are already normalized if the spec asks for it.
+std::vector<float> train_coarse(const IVFPQSpec &spec, int nlist,
+                                std::span<const float> vecs) {
+        if (spec.coarse == CoarseQuantizer::MultiIndex) {
+                const int k = (int)std::lround(std::sqrt((double)nlist));
+                math::MultiIndex multi(spec.dim, k);
+                multi.train(vecs);
+                const auto cb = multi.codebooks();
+                return std::vector<float>(cb.begin(), cb.end());
+        }
+        return math::clustering::KMeans(nlist, spec.dim).fit(vecs);
+}
+
+bool dominates(const TunePoint &a, const TunePoint &b) {
+        const bool no_worse = a.recall >= b.recall &&
+                              a.latency_us <= b.latency_us &&
+                              a.memory_bytes <= b.memory_bytes;
+        const bool better = a.recall > b.recall ||
+                            a.latency_us < b.latency_us ||
+                            a.memory_bytes < b.memory_bytes;
+        return no_worse && better;
+}
+
+} // namespace
+
+// Explores M, then nlist, then nprobe in increasing order. Coarse centroids
+// are trained once per nlist. PQ codebooks are trained once per M, on
+// residuals to the middle nlist's centroids, and shared with every other
+// nlist, so the grid costs one PQ training per M. Each built index is
+// reused for the whole nprobe sweep. A sweep stops once the target is
+// reached or the latency budget is exceeded, since larger nprobe values are
+// only slower.
+TuneResult tune_ivfpq(const IVFPQSpec &base, std::span<const float> sample,
+                      std::span<const float> queries,
+                      const TuneOptions &options) {
+        const int dim = base.dim;
+        const int n = sample.size() / dim;
+        const int nq = queries.size() / dim;
+        const int k = options.k;
+
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+
+        FlatIndex exact(Spec{dim, base.metric, base.normalize, base.memory});
+        exact.add(ids, sample);
+        std::vector<std::vector<Hit>> truth(nq);
+        for (int i = 0; i < nq; i++)
+                truth[i] = exact.search(queries.subspan(i * dim, dim), k);
+
+        auto within_budget = [&](const TunePoint &p) {
+                return (options.max_latency_us <= 0.0 ||
+                        p.latency_us <= options.max_latency_us) &&
+                       (options.max_memory_bytes == 0 ||
+                        p.memory_bytes <= options.max_memory_bytes);
+        };
+
+        std::vector<int> nlists;
+        for (int nlist : sorted_unique(options.nlists.empty()
+                                           ? default_nlists(n, base.coarse)
+                                           : options.nlists))
+                if (nlist <= n && (base.coarse != CoarseQuantizer::MultiIndex ||
+                                   is_square(nlist)))
+                        nlists.push_back(nlist);
+        const auto Ms =
+            sorted_unique(options.Ms.empty() ? default_Ms(dim) : options.Ms);
+
+        std::vector<float> work;
+        std::span<const float> train_vecs = sample;
+        if (base.normalize) {
+                work.assign(sample.begin(), sample.end());
+                for (int i = 0; i < n; i++)
+                        math::kernels::normalize(work.data() + i * dim, dim);
+                train_vecs = work;
+        }
+        std::vector<std::vector<float>> coarse;
+        for (int nlist : nlists)
+                coarse.push_back(train_coarse(base, nlist, train_vecs));
+        const int ref = nlists.size() / 2;
+
+        std::vector<TunePoint> points;
+        for (int M : Ms) {
+                if (nlists.empty())
+                        break;
+                // Codes alone set a floor on the index size.
+                if (options.max_memory_bytes > 0 &&
+                    (size_t)n * M > options.max_memory_bytes)
+                        break;
+
+                IVFPQSpec ref_spec = base;
+                ref_spec.nlist = nlists[ref];
+                ref_spec.M = M;
+                const auto trained =
+                    IVFPQQuantizer::train(ref_spec, sample, coarse[ref]);
+
+                for (size_t j = 0; j < nlists.size(); j++) {
+                        const int nlist = nlists[j];
+                        IVFPQSpec spec = base;
+                        spec.nlist = nlist;
+                        spec.M = M;
+                        IVFPQIndex index(spec, (int)j == ref
+                                                   ? trained
+                                                   : trained->with_centroids(
+                                                         coarse[j]));
+                        index.add(ids, sample);
+                        const size_t bytes = index_bytes(index, spec);
+
+                        const auto nprobes = sorted_unique(
+                            options.nprobes.empty() ? default_nprobes(nlist)
+                                                    : options.nprobes);
+                        for (int nprobe : nprobes) {
+                                if (nprobe > nlist)
+                                        break;
+                                index.set_nprobe(nprobe);
+
+                                // Only the searches are timed; recall is
+                                // scored once they are done.
+                                std::vector<std::vector<Hit>> hits(nq);
+                                const auto start = Clock::now();
+                                for (int i = 0; i < nq; i++)
+                                        hits[i] = index.search(
+                                            queries.subspan(i * dim, dim), k);
+                                const auto elapsed =
+                                    std::chrono::duration<double, std::micro>(
+                                        Clock::now() - start)
+                                        .count();
+                                float recall = 0.0f;
+                                for (int i = 0; i < nq; i++)
+                                        recall +=
+                                            recall_at_k(hits[i], truth[i]);
+
+                                TunePoint p;
+                                p.nlist = nlist;
+                                p.M = M;
+                                p.nprobe = nprobe;
+                                p.recall = nq > 0 ? recall / nq : 0.0f;
+                                p.latency_us = nq > 0 ? elapsed / nq : 0.0;
+                                p.memory_bytes = bytes;
+                                points.push_back(p);
+
+                                if (p.recall >= options.target_recall ||
+                                    !within_budget(p))
+                                        break;
+                        }
+                }
+        }
+
+        TuneResult result;
+        result.spec = base;
+        const TunePoint *best = nullptr;
+        for (const TunePoint &p : points) {
+                if (!within_budget(p))
+                        continue;
+                const bool met = p.recall >= options.target_recall;
+                if (!best || (met && !result.met) ||
+                    (met && p.latency_us < best->latency_us) ||
+                    (!met && !result.met && p.recall > best->recall)) {
+                        best = &p;
+                        result.met = met;
+                }
+        }
+        if (best) {
+                result.best = *best;
+                result.spec.nlist = best->nlist;
+                result.spec.M = best->M;
+                result.spec.nprobe = best->nprobe;
+        }
+
+        for (const TunePoint &p : points)
+                if (std::none_of(points.begin(), points.end(),
+                                 [&](const TunePoint &o) {
+                                         return dominates(o, p);
+                                 }))
+                        result.frontier.push_back(p);
+        std::sort(result.frontier.begin(), result.frontier.end(),
+                  [](const TunePoint &a, const TunePoint &b) {
+                          return a.latency_us < b.latency_us;
+                  });
+        return result;
+}
+
+} // namespace spheni
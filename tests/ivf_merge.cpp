@@ -0,0 +1,59 @@
+// IVF shards merge only when they are trained over the same centroids with
+// the same metric and normalization. A mismatch, or merging an index into
+// itself, must be rejected and leave the index untouched.
+
+#include "spheni.h"
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <vector>
+
+int main() {
+        const int dim = 16, n = 3000;
+        std::mt19937 rng(13);
+        std::normal_distribution<float> normal;
+        std::vector<float> vecs(n * dim);
+        for (auto &x : vecs)
+                x = normal(rng);
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::span<const float> all(vecs);
+        std::span<const long long> all_ids(ids);
+
+        spheni::IVFSpec spec;
+        spec.dim = dim;
+        spec.metric = spheni::Metric::L2;
+        spec.normalize = false;
+        spec.nlist = 16;
+        spheni::IVFIndex index(spec);
+        index.train(all_ids.first(n / 2), all.first(n / 2 * dim));
+
+        int failures = 0;
+
+        // Cosine over normalized vectors, trained on the same data.
+        spheni::IVFSpec cosine = spec;
+        cosine.metric = spheni::Metric::Cosine;
+        cosine.normalize = true;
+        spheni::IVFIndex other(cosine);
+        failures += other.copy_quantizer(index);
+        other.train(all_ids.subspan(n / 2), all.subspan(n / 2 * dim));
+        failures += index.merge(other) || other.merge(index);
+
+        // Same metric, other normalization.
+        spheni::IVFSpec normalized = spec;
+        normalized.normalize = true;
+        spheni::IVFIndex norm(normalized);
+        failures += norm.copy_quantizer(index);
+
+        failures += index.merge(index) || index.copy_quantizer(index);
+        failures += index.size() != n / 2 || other.size() != n / 2;
+
+        // A shard on the same centroids is accepted.
+        spheni::IVFIndex shard(spec);
+        failures += !shard.copy_quantizer(index);
+        shard.add(all_ids.subspan(n / 2), all.subspan(n / 2 * dim));
+        failures += !index.merge(shard) || index.size() != n;
+
+        std::printf("failures=%d\n", failures);
+        return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+// IVF-PQ shards merge only when they share a quantizer trained for the same
+// metric, normalization and coarse quantizer type. A mismatch must be
+// rejected and leave the index untouched.
+
+#include "spheni.h"
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <vector>
+
+int main() {
+        const int dim = 16, n = 2000;
+        std::mt19937 rng(11);
+        std::normal_distribution<float> normal;
+        std::vector<float> vecs(n * dim);
+        for (auto &x : vecs)
+                x = normal(rng);
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::span<const float> all(vecs);
+        std::span<const long long> all_ids(ids);
+
+        spheni::IVFPQSpec spec;
+        spec.dim = dim;
+        spec.metric = spheni::Metric::L2;
+        spec.nlist = 16;
+        spec.M = 4;
+        spec.ksub = 32;
+        spheni::IVFPQIndex index(spec);
+        index.train(vecs);
+        index.add(all_ids.first(n / 2), all.first(n / 2 * dim));
+
+        int failures = 0;
+
+        // Same quantizer and spec: accepted.
+        spheni::IVFPQIndex shard(spec);
+        failures += !shard.copy_quantizer(index);
+        shard.add(all_ids.subspan(n / 2), all.subspan(n / 2 * dim));
+
+        // Cosine over the L2 index's centroids: same shapes, other metric.
+        spheni::IVFPQSpec cosine = spec;
+        cosine.metric = spheni::Metric::Cosine;
+        spheni::IVFPQIndex other(cosine);
+        failures += other.copy_quantizer(index);
+        other.train(vecs, index.centroids());
+        other.add(all_ids.subspan(n / 2), all.subspan(n / 2 * dim));
+        failures += index.merge(other) || other.merge(index);
+        failures += index.size() != n / 2 || other.size() != n / 2;
+
+        // Same metric, but vectors normalized on one side only.
+        spheni::IVFPQSpec unnormalized = spec;
+        unnormalized.normalize = false;
+        spheni::IVFPQIndex raw(unnormalized);
+        failures += raw.copy_quantizer(index);
+
+        failures += !index.merge(shard) || index.size() != n;
+        std::printf("failures=%d\n", failures);
+        return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// A resumable IVF-PQ search moved between steps, as an event loop does when
+// it keeps in-flight searches in a container, must finish with the same hits
+// as a blocking search. Each step must stay within its budget even across
+// empty cells, and a stopped search must report only the work it did.
+
+#include "spheni.h"
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+static_assert(std::is_nothrow_move_constructible_v<spheni::IVFPQIndex::Search>);
+static_assert(std::is_nothrow_move_assignable_v<spheni::IVFPQIndex::Search>);
+
+int main() {
+        const int dim = 32, n = 5000, nq = 20;
+        std::mt19937 rng(9);
+        std::normal_distribution<float> normal;
+        std::vector<float> vecs(n * dim);
+        for (auto &x : vecs)
+                x = normal(rng);
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::span<const float> queries(vecs.data(), nq * dim);
+
+        int failures = 0;
+        for (spheni::Metric metric : {spheni::Metric::L2,
+                                      spheni::Metric::Cosine}) {
+                spheni::IVFPQSpec spec;
+                spec.dim = dim;
+                spec.metric = metric;
+                spec.nlist = 16;
+                spec.nprobe = 4;
+                spec.M = 8;
+                spec.ksub = 64;
+                spheni::IVFPQIndex index(spec);
+                index.train(vecs);
+                index.add(ids, vecs);
+
+                std::vector<spheni::IVFPQIndex::Search> inflight;
+                for (int i = 0; i < nq; i++) {
+                        spheni::IVFPQIndex::Search search(
+                            index, queries.subspan(i * dim, dim), 10);
+                        search.step(100);
+                        inflight.push_back(std::move(search));
+                }
+                // Growing the vector moves every search again.
+                bool running = true;
+                while (running) {
+                        running = false;
+                        for (auto &search : inflight)
+                                running |= search.step(100);
+                }
+
+                int mismatches = 0;
+                for (int i = 0; i < nq; i++) {
+                        const auto expected =
+                            index.search(queries.subspan(i * dim, dim), 10);
+                        const auto got = inflight[i].results();
+                        bool same = expected.size() == got.size();
+                        for (size_t j = 0; same && j < got.size(); j++)
+                                same = expected[j].id == got[j].id;
+                        mismatches += !same;
+                }
+                std::printf("metric=%d mismatched queries=%d\n", (int)metric,
+                            mismatches);
+                failures += mismatches > 0;
+        }
+
+        // Most of a 64 x 64 multi-index is empty. step(1) visits at most one
+        // cell, so probing every cell takes at least nlist steps.
+        spheni::IVFPQSpec spec;
+        spec.dim = dim;
+        spec.nlist = 64 * 64;
+        spec.nprobe = spec.nlist;
+        spec.M = 8;
+        spec.ksub = 64;
+        spec.coarse = spheni::CoarseQuantizer::MultiIndex;
+        spheni::IVFPQIndex multi(spec);
+        multi.train(vecs);
+        multi.add(ids, vecs);
+        spheni::SearchStats stats;
+        spheni::IVFPQIndex::Search search(multi, queries.first(dim), 10,
+                                          &stats);
+        long long steps = 0;
+        while (stats.codes_scanned == 0 && !search.done()) {
+                search.step(1);
+                steps++;
+        }
+        // Stopped after its first block of at most 256 codes: counters
+        // cover that block only.
+        const bool partial_ok =
+            stats.codes_scanned == search.codes_scanned() &&
+            stats.codes_scanned <= 256 &&
+            stats.heap_pushes > 0;
+        while (!search.done()) {
+                search.step(1);
+                steps++;
+        }
+        std::printf("multi-index steps=%lld codes=%lld pushes=%lld\n", steps,
+                    stats.codes_scanned, stats.heap_pushes);
+        failures += !partial_ok || steps < spec.nlist ||
+                    stats.codes_scanned != n;
+        return failures == 0 ? 0 : 1;
+}
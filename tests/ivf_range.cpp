@@ -0,0 +1,73 @@
+// IVF range search must match FlatIndex range search when every cell is
+// probed, for both metrics and with and without normalization.
+
+#include "spheni.h"
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <set>
+#include <vector>
+
+int main() {
+        const int dim = 32, n = 10000, nq = 30, nclusters = 50;
+        std::mt19937 rng(3);
+        std::normal_distribution<float> normal;
+
+        // Large vectors around the origin, where raw and normalized
+        // distances to a centroid disagree the most.
+        std::vector<float> centers(nclusters * dim);
+        for (auto &x : centers)
+                x = normal(rng);
+        std::vector<float> vecs(n * dim);
+        for (int i = 0; i < n; i++)
+                for (int d = 0; d < dim; d++)
+                        vecs[i * dim + d] =
+                            10.0f * (centers[(i % nclusters) * dim + d] +
+                                     normal(rng));
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::span<const float> queries(vecs.data(), nq * dim);
+
+        int failures = 0;
+        for (spheni::Metric metric : {spheni::Metric::L2,
+                                      spheni::Metric::Cosine}) {
+                for (bool normalize : {true, false}) {
+                        spheni::Spec spec{dim, metric, normalize};
+                        spheni::FlatIndex flat(spec);
+                        flat.add(ids, vecs);
+
+                        spheni::IVFIndex ivf(spheni::IVFSpec{spec, 64, 64});
+                        ivf.train(ids, vecs);
+
+                        // Halfway between the 50th and 51st neighbour of the
+                        // first query, so no hit sits on the boundary.
+                        const auto top = flat.search(queries.first(dim), 51);
+                        const float min_score =
+                            (top[49].score + top[50].score) / 2;
+                        const float radius = metric == spheni::Metric::L2
+                                                 ? -min_score
+                                                 : 1.0f - min_score;
+
+                        const auto expected =
+                            flat.range_search_batch(queries, radius);
+                        long long hits = 0, mismatches = 0;
+                        for (int i = 0; i < nq; i++) {
+                                const auto got = ivf.range_search(
+                                    queries.subspan(i * dim, dim), radius);
+                                std::set<long long> a, b;
+                                for (const auto &h : expected[i])
+                                        a.insert(h.id);
+                                for (const auto &h : got)
+                                        b.insert(h.id);
+                                hits += a.size();
+                                mismatches += a != b;
+                        }
+                        std::printf("metric=%d normalize=%d hits=%lld "
+                                    "mismatched queries=%lld\n",
+                                    (int)metric, (int)normalize, hits,
+                                    mismatches);
+                        failures += mismatches > 0 || hits == 0;
+                }
+        }
+        return failures == 0 ? 0 : 1;
+}
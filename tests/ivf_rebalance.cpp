@@ -0,0 +1,110 @@
+// Rebalancing an IVF or IVF-PQ index after drift must keep recall close to
+// what it was, with and without normalization, and must not lose vectors.
+
+#include "spheni.h"
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace {
+
+template <class Index>
+double recall_at_10(const Index &index, const spheni::FlatIndex &flat,
+                    std::span<const float> queries, int dim) {
+        const int nq = queries.size() / dim;
+        int found = 0;
+        for (int i = 0; i < nq; i++) {
+                const auto q = queries.subspan(i * dim, dim);
+                std::set<long long> truth;
+                for (const auto &h : flat.search(q, 10))
+                        truth.insert(h.id);
+                for (const auto &h : index.search(q, 10))
+                        found += truth.count(h.id);
+        }
+        return (double)found / (10 * nq);
+}
+
+} // namespace
+
+int main() {
+        const int dim = 32, n = 20000, nq = 100;
+        std::mt19937 rng(5);
+        std::normal_distribution<float> normal;
+
+        // Training data spreads over the space; a third of the later adds
+        // pile into one region, so a few lists grow far beyond the mean.
+        std::vector<float> vecs(n * dim);
+        for (int i = 0; i < n; i++) {
+                const bool hot = i >= n / 4 && i % 3 == 0;
+                for (int d = 0; d < dim; d++)
+                        vecs[i * dim + d] = hot ? 5.0f + 2.0f * normal(rng)
+                                                : 10.0f * normal(rng);
+        }
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        const int ntrain = n / 4;
+        std::span<const float> all(vecs);
+        std::span<const float> queries = all.last(nq * dim);
+
+        int failures = 0;
+        for (bool normalize : {true, false}) {
+                const spheni::Spec spec{dim, spheni::Metric::L2, normalize};
+                spheni::FlatIndex flat(spec);
+                flat.add(ids, vecs);
+
+                spheni::IVFIndex ivf(spheni::IVFSpec{spec, 32, 8});
+                ivf.train(std::span<const long long>(ids).first(ntrain),
+                          all.first(ntrain * dim));
+                ivf.add(std::span<const long long>(ids).subspan(ntrain),
+                        all.subspan(ntrain * dim));
+
+                const double before = recall_at_10(ivf, flat, queries, dim);
+                const auto report = ivf.rebalance();
+                const double after = recall_at_10(ivf, flat, queries, dim);
+                std::printf("normalize=%d splits=%d merges=%d recall@10 "
+                            "%.3f -> %.3f\n",
+                            (int)normalize, report.splits, report.merges,
+                            before, after);
+                // Splitting shrinks the lists nprobe covers, so recall may
+                // dip a little.
+                failures += after < before - 0.03 || ivf.size() != n ||
+                            report.splits == 0;
+        }
+
+        // Split lists keep their PQ codes, so only the few vectors of
+        // dissolved lists pick up a second round of quantization error, and
+        // recall may dip less than it would from re-encoding.
+        for (spheni::Metric metric : {spheni::Metric::L2,
+                                      spheni::Metric::Cosine}) {
+                for (bool normalize : {true, false}) {
+                        const spheni::Spec spec{dim, metric, normalize};
+                        spheni::FlatIndex flat(spec);
+                        flat.add(ids, vecs);
+
+                        spheni::IVFPQSpec pq_spec;
+                        static_cast<spheni::Spec &>(pq_spec) = spec;
+                        pq_spec.nlist = 32;
+                        pq_spec.nprobe = 8;
+                        pq_spec.M = 8;
+                        pq_spec.ksub = 128;
+                        spheni::IVFPQIndex ivfpq(pq_spec);
+                        ivfpq.train(all.first(ntrain * dim));
+                        ivfpq.add(ids, vecs);
+
+                        const double before =
+                            recall_at_10(ivfpq, flat, queries, dim);
+                        const auto report = ivfpq.rebalance();
+                        const double after =
+                            recall_at_10(ivfpq, flat, queries, dim);
+                        std::printf("ivfpq metric=%d normalize=%d splits=%d "
+                                    "merges=%d recall@10 %.3f -> %.3f\n",
+                                    (int)metric, (int)normalize, report.splits,
+                                    report.merges, before, after);
+                        failures += after < before - 0.01 ||
+                                    ivfpq.size() != n || report.splits == 0;
+                }
+        }
+        return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+// The multi-sequence iterator must hand out every cell of a multi-index
+// exactly once, in non-decreasing distance, and a multi-index search that
+// probes every cell must match an exhaustive scan of every code.
+
+#include "math/multi_index.h"
+#include "spheni.h"
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <set>
+#include <vector>
+
+int main() {
+        const int dim = 16, n = 3000, k = 12;
+        std::mt19937 rng(19);
+        std::normal_distribution<float> normal;
+        std::vector<float> vecs(n * dim);
+        for (auto &x : vecs)
+                x = normal(rng);
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+
+        int failures = 0;
+
+        spheni::math::MultiIndex multi(dim, k);
+        multi.train(vecs);
+        std::vector<float> centroid(dim);
+        for (int qi = 0; qi < 5; qi++) {
+                const float *q = vecs.data() + qi * dim;
+                spheni::math::MultiSequence sequence(multi, q);
+                std::set<int> seen;
+                std::pair<float, int> cell;
+                float last = -1.0f;
+                int order_errors = 0, dist_errors = 0;
+                while (sequence.next(cell)) {
+                        order_errors += cell.first < last ||
+                                        !seen.insert(cell.second).second;
+                        last = cell.first;
+                        multi.centroid(cell.second, centroid.data());
+                        float d = 0.0f;
+                        for (int i = 0; i < dim; i++)
+                                d += (q[i] - centroid[i]) * (q[i] - centroid[i]);
+                        dist_errors +=
+                            std::fabs(d - cell.first) > 1e-3f * (1.0f + d);
+                }
+                std::printf("query %d: cells=%zu order errors=%d distance "
+                            "errors=%d\n",
+                            qi, seen.size(), order_errors, dist_errors);
+                failures += (int)seen.size() != k * k || order_errors > 0 ||
+                            dist_errors > 0;
+        }
+
+        spheni::IVFPQSpec spec;
+        spec.dim = dim;
+        spec.metric = spheni::Metric::L2;
+        spec.nlist = k * k;
+        spec.nprobe = k * k;
+        spec.M = 4;
+        spec.ksub = 64;
+        spec.coarse = spheni::CoarseQuantizer::MultiIndex;
+        spheni::IVFPQIndex index(spec);
+        index.train(vecs);
+        index.add(ids, vecs);
+
+        // With k = n every code is scored, which is the exhaustive scan.
+        int mismatches = 0;
+        for (int qi = 0; qi < 20; qi++) {
+                const auto q = std::span<const float>(vecs).subspan(
+                    (n - 1 - qi) * dim, dim);
+                const auto all = index.search(q, n);
+                std::set<long long> distinct;
+                for (const auto &h : all)
+                        distinct.insert(h.id);
+                failures += (int)all.size() != n || (int)distinct.size() != n;
+                const auto top = index.search(q, 10);
+                for (int i = 0; i < 10; i++)
+                        mismatches += top[i].score != all[i].score;
+        }
+        std::printf("exhaustive mismatches=%d\n", mismatches);
+        failures += mismatches > 0;
+        return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+// CachedIndex must serve a query only results computed for that exact
+// query: q and 2q collide only when normalization is asked for, and an add
+// through the wrapper must invalidate what was cached before it.
+
+#include "spheni.h"
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace {
+
+bool same_hits(const std::vector<spheni::Hit> &a,
+               const std::vector<spheni::Hit> &b) {
+        if (a.size() != b.size())
+                return false;
+        for (size_t i = 0; i < a.size(); i++)
+                if (a[i].id != b[i].id || a[i].score != b[i].score)
+                        return false;
+        return true;
+}
+
+} // namespace
+
+int main() {
+        const int dim = 16, n = 1000;
+        std::mt19937 rng(17);
+        std::normal_distribution<float> normal;
+        std::vector<float> vecs(n * dim);
+        for (auto &x : vecs)
+                x = normal(rng);
+        std::vector<long long> ids(n);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::vector<float> q(vecs.begin(), vecs.begin() + dim);
+        std::vector<float> q2(q);
+        for (auto &x : q2)
+                x *= 2.0f;
+
+        int failures = 0;
+
+        // Unnormalized L2 and inner-product indexes: scale changes results,
+        // so the default exact key must keep q and 2q apart.
+        for (spheni::Metric metric : {spheni::Metric::L2,
+                                      spheni::Metric::Cosine}) {
+                spheni::FlatIndex index(spheni::Spec{dim, metric, false});
+                index.add(ids, vecs);
+                spheni::CachedIndex<spheni::FlatIndex> cached(index);
+                cached.search(q, 10);
+                const auto got = cached.search(q2, 10);
+                const bool ok = same_hits(got, index.search(q2, 10)) &&
+                                cached.cache().hits() == 0;
+                std::printf("metric=%d exact key separates q and 2q: %d\n",
+                            (int)metric, (int)ok);
+                failures += !ok;
+        }
+
+        // A normalizing index gives q and 2q the same results, and opting
+        // into a normalized key lets them share an entry.
+        {
+                spheni::FlatIndex index(
+                    spheni::Spec{dim, spheni::Metric::Cosine, true});
+                index.add(ids, vecs);
+                spheni::CacheOptions options;
+                options.normalize = true;
+                spheni::CachedIndex<spheni::FlatIndex> cached(index, options);
+                cached.search(q, 10);
+                cached.search(q2, 10);
+                failures += cached.cache().hits() != 1;
+        }
+
+        // Adding through the wrapper invalidates earlier entries.
+        {
+                spheni::FlatIndex index(
+                    spheni::Spec{dim, spheni::Metric::L2, false});
+                index.add(ids, vecs);
+                spheni::CachedIndex<spheni::FlatIndex> cached(index);
+                cached.search(q, 10);
+                cached.search(q, 10);
+                const bool hit = cached.cache().hits() == 1;
+
+                const long long new_id = n;
+                std::vector<float> near(q);
+                near[0] += 1e-3f;
+                cached.add(std::span<const long long>(&new_id, 1), near);
+                const auto got = cached.search(q, 10);
+                const bool fresh = cached.cache().hits() == 1 &&
+                                   same_hits(got, index.search(q, 10)) &&
+                                   got.size() > 1 && got[1].id == new_id;
+                std::printf("hit before add: %d, fresh after add: %d\n",
+                            (int)hit, (int)fresh);
+                failures += !hit || !fresh;
+        }
+        return failures == 0 ? 0 : 1;
+}